@@ -25,6 +25,8 @@
 #include "ngx_base_fetch.h"
 #include "ngx_event_connection.h"
 #include "ngx_list_iterator.h"
+#include "ngx_output_compressor.h"
+#include "ngx_rewrite_options.h"
 
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
@@ -62,12 +64,26 @@ NgxBaseFetch::NgxBaseFetch(StringPiece url,
       base_fetch_type_(base_fetch_type),
       preserve_caching_headers_(preserve_caching_headers),
       detached_(false),
-      suppress_(false) {
+      suppress_(false),
+      html_compression_level_(0),
+      html_compression_window_bits_(0),
+      compressor_(NULL) {
   if (pthread_mutex_init(&mutex_, NULL)) CHECK(0);
+  // options may be owned by a custom driver that's gone by the time nginx
+  // collects our headers, so copy out what the nginx side needs now.
+  const NgxRewriteOptions* ngx_options =
+      NgxRewriteOptions::DynamicCast(options);
+  if (ngx_options != NULL) {
+    html_compression_level_ = ngx_options->html_compression_level();
+    html_compression_window_bits_ =
+        ngx_options->html_compression_window_bits();
+  }
   __sync_add_and_fetch(&NgxBaseFetch::active_base_fetches, 1);
 }
 
 NgxBaseFetch::~NgxBaseFetch() {
+  // Detach() normally hands the compressor back for reuse.
+  delete compressor_;
   pthread_mutex_destroy(&mutex_);
   __sync_add_and_fetch(&NgxBaseFetch::active_base_fetches, -1);
 }
@@ -256,11 +272,58 @@ ngx_int_t NgxBaseFetch::CopyBufferToNginx(ngx_chain_t** link_ptr) {
 ngx_int_t NgxBaseFetch::CollectAccumulatedWrites(ngx_chain_t** link_ptr) {
   ngx_int_t rc;
   Lock();
+  if (compressor_ != NULL) {
+    // Take what's buffered and compress it after unlocking, so pagespeed can
+    // keep writing while zlib runs.
+    bool done = done_called_;
+    bool flush = need_flush_;
+    need_flush_ = false;
+    compress_input_.swap(buffer_);
+    Unlock();
+    return CompressToNginx(done, flush, link_ptr);
+  }
   rc = CopyBufferToNginx(link_ptr);
   Unlock();
   return rc;
 }
 
+// should only be called in nginx thread
+ngx_int_t NgxBaseFetch::CompressToNginx(bool done, bool flush,
+                                        ngx_chain_t** link_ptr) {
+  CHECK(!(done && last_buf_sent_))
+        << "CompressToNginx() was called after the last buffer was sent";
+
+  GoogleString compressed;
+  bool ok = compressor_->Compress(compress_input_, flush, done, &compressed);
+  compress_input_.clear();
+  if (!ok) {
+    return NGX_ERROR;
+  }
+  if (done) {
+    NgxOutputCompressor::Release(compressor_);
+    compressor_ = NULL;
+  }
+
+  // zlib may hold on to small writes until it has a block's worth.
+  if (!done && compressed.empty()) {
+    *link_ptr = NULL;
+    return NGX_AGAIN;
+  }
+
+  int rc = string_piece_to_buffer_chain(request_->pool, compressed, link_ptr,
+                                        done /* send_last_buf */, flush);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  if (done) {
+    last_buf_sent_ = true;
+    return NGX_OK;
+  }
+
+  return NGX_AGAIN;
+}
+
 ngx_int_t NgxBaseFetch::CollectHeaders(ngx_http_headers_out_t* headers_out) {
   // nginx defines _FILE_OFFSET_BITS to 64, which changes the size of off_t.
   // If a standard header is accidentally included before the nginx header,
@@ -276,8 +339,52 @@ ngx_int_t NgxBaseFetch::CollectHeaders(ngx_http_headers_out_t* headers_out) {
      headers_out->content_length_n = content_length();
   }
 
-  return copy_response_headers_to_ngx(request_, *pagespeed_headers,
-                                      preserve_caching_headers_);
+  ngx_int_t rc = copy_response_headers_to_ngx(request_, *pagespeed_headers,
+                                              preserve_caching_headers_);
+  if (rc == NGX_OK && base_fetch_type_ == kHtmlTransform) {
+    rc = StartCompression(headers_out);
+  }
+  return rc;
+}
+
+ngx_int_t NgxBaseFetch::StartCompression(ngx_http_headers_out_t* headers_out) {
+#if (NGX_HTTP_GZIP)
+  if (html_compression_level_ <= 0 ||
+      request_->header_only || headers_out->status != NGX_HTTP_OK ||
+      (headers_out->content_encoding != NULL &&
+       headers_out->content_encoding->value.len > 0)) {
+    return NGX_OK;
+  }
+
+  // Whether or not this client gets gzip, the response varies on it.  The
+  // header filter only sends Vary: Accept-Encoding if gzip_vary is on.
+  request_->gzip_vary = 1;
+  if (ngx_http_gzip_ok(request_) != NGX_OK) {
+    return NGX_OK;
+  }
+
+  compressor_ = NgxOutputCompressor::Acquire(
+      html_compression_level_, html_compression_window_bits_,
+      server_context_->statistics(), server_context_->timer(),
+      server_context_->message_handler());
+  if (compressor_ == NULL) {
+    return NGX_OK;
+  }
+
+  // nginx's gzip filter leaves responses that already have a
+  // Content-Encoding alone.
+  ngx_table_elt_t* content_encoding = static_cast<ngx_table_elt_t*>(
+      ngx_list_push(&headers_out->headers));
+  if (content_encoding == NULL) {
+    return NGX_ERROR;
+  }
+  content_encoding->hash = 1;
+  ngx_str_set(&content_encoding->key, "Content-Encoding");
+  ngx_str_set(&content_encoding->value, "gzip");
+  headers_out->content_encoding = content_encoding;
+  ngx_http_clear_content_length(request_);
+#endif
+  return NGX_OK;
 }
 
 void NgxBaseFetch::RequestCollection(char type) {
@@ -326,6 +433,15 @@ bool NgxBaseFetch::HandleFlush(MessageHandler* handler) {
   return true;
 }
 
+void NgxBaseFetch::Detach() {
+  if (compressor_ != NULL) {
+    NgxOutputCompressor::Release(compressor_);
+    compressor_ = NULL;
+  }
+  detached_ = true;
+  DecrementRefCount();
+}
+
 int NgxBaseFetch::DecrementRefCount() {
   return DecrefAndDeleteIfUnreferenced();
 }
@@ -71,6 +71,8 @@ extern "C" {
 
 namespace net_instaweb {
 
+class NgxOutputCompressor;
+
 enum NgxBaseFetchType {
   kIproLookup,
   kHtmlTransform,
@@ -127,7 +129,7 @@ class NgxBaseFetch : public AsyncFetch {
   // sets detached_ to true and decrements the refcount. We need to know
   // this to be able to handle events which nginx request context has been
   // released while the event was in-flight.
-  void Detach() { detached_ = true; DecrementRefCount(); }
+  void Detach();
 
   bool detached() { return detached_; }
 
@@ -155,6 +157,14 @@ class NgxBaseFetch : public AsyncFetch {
   // buffer_.
   ngx_int_t CopyBufferToNginx(ngx_chain_t** link_ptr);
 
+  // Like CopyBufferToNginx(), for output we're gzipping ourselves: compresses
+  // compress_input_ into a chain.  Called without the lock held.
+  ngx_int_t CompressToNginx(bool done, bool flush, ngx_chain_t** link_ptr);
+
+  // For html transforms, sets up compressor_ if HtmlCompressionLevel is set and
+  // the client accepts gzip, and marks the response as gzipped.
+  ngx_int_t StartCompression(ngx_http_headers_out_t* headers_out);
+
   void Lock();
   void Unlock();
 
@@ -171,6 +181,8 @@ class NgxBaseFetch : public AsyncFetch {
   ngx_http_request_t* request_;
   GoogleString buffer_;
   NgxServerContext* server_context_;
+  // May be owned by the request's driver, and so only valid while PSOL is
+  // working on the request.  The nginx side mustn't touch it.
   const RewriteOptions* options_;
   bool need_flush_;
   bool done_called_;
@@ -186,6 +198,14 @@ class NgxBaseFetch : public AsyncFetch {
   // Set to true just before the nginx side releases its reference
   bool detached_;
   bool suppress_;
+  // Copied from the options when we're created, for the nginx thread.
+  int html_compression_level_;
+  int html_compression_window_bits_;
+  // Only used on the nginx thread.  NULL unless we're compressing the output.
+  NgxOutputCompressor* compressor_;
+  // Buffered output waiting to be compressed, swapped out of buffer_ so
+  // compression doesn't hold the lock.
+  GoogleString compress_input_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxBaseFetch);
 };
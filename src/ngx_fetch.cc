@@ -40,6 +40,7 @@ extern "C" {
 }
 
 #include "ngx_fetch.h"
+#include "ngx_fetch_origins.h"
 
 #include "base/logging.h"
 
@@ -72,6 +73,7 @@ namespace net_instaweb {
 
 NgxConnection::NgxConnectionPool NgxConnection::connection_pool;
 PthreadMutex NgxConnection::connection_pool_mutex;
+ngx_event_t NgxConnection::idle_sweep_event;
 // Default keepalive 60s.
 const int64 NgxConnection::keepalive_timeout_ms = 60000;
 const GoogleString NgxConnection::ka_header =
@@ -83,6 +85,7 @@ NgxConnection::NgxConnection(MessageHandler* handler,
   c_ = NULL;
   max_keepalive_requests_ = max_keepalive_requests;
   handler_ = handler;
+  idle_deadline_ms_ = 0;
   // max_keepalive_requests specifies the number of http requests that are
   // allowed to be performed over a single connection. So, a
   // max_keepalive_requests of 1 effectively disables keepalive.
@@ -94,6 +97,9 @@ NgxConnection::~NgxConnection() {
 }
 
 void NgxConnection::Terminate() {
+  if (idle_sweep_event.timer_set) {
+    ngx_del_timer(&idle_sweep_event);
+  }
   for (NgxConnectionPool::iterator p = connection_pool.begin();
        p != connection_pool.end(); ++p) {
     NgxConnection* nc = *p;
@@ -190,8 +196,8 @@ void NgxConnection::Close() {
     return;
   }
 
-  ngx_add_timer(c_->read, static_cast<ngx_msec_t>(
-      NgxConnection::keepalive_timeout_ms));
+  idle_deadline_ms_ = ngx_current_msec + static_cast<ngx_msec_t>(
+      NgxConnection::keepalive_timeout_ms);
 
   c_->data = this;
   c_->read->handler = NgxConnection::IdleReadHandler;
@@ -214,6 +220,39 @@ void NgxConnection::Close() {
                   "NgxFetch: Added connection %p (pool size: %l - "
                   " max_keepalive_requests_ %d)",
                   this, connection_pool.size(), max_keepalive_requests_);
+
+    // If the sweep timer is already armed it fires for an older connection,
+    // and will re-arm itself for this one.
+    if (!idle_sweep_event.timer_set) {
+      idle_sweep_event.handler = NgxConnection::IdleSweepHandler;
+      idle_sweep_event.log = ngx_cycle->log;
+      ngx_add_timer(&idle_sweep_event, static_cast<ngx_msec_t>(
+          NgxConnection::keepalive_timeout_ms));
+    }
+  }
+}
+
+void NgxConnection::IdleSweepHandler(ngx_event_t* ev) {
+  // Connections are appended to the pool when they become idle and they all
+  // share the same timeout, so the oldest one is always the first to expire.
+  for (;;) {
+    NgxConnection* nc;
+    {
+      ScopedMutex lock(&NgxConnection::connection_pool_mutex);
+      if (connection_pool.empty()) {
+        return;
+      }
+      nc = connection_pool.oldest();
+      ngx_msec_int_t left = static_cast<ngx_msec_int_t>(
+          nc->idle_deadline_ms_ - ngx_current_msec);
+      if (left > 0) {
+        ngx_add_timer(ev, static_cast<ngx_msec_t>(left));
+        return;
+      }
+    }
+    // Close() takes the connection out of the pool.
+    nc->set_keepalive(false);
+    nc->Close();
   }
 }
 
@@ -232,13 +271,6 @@ void NgxConnection::IdleWriteHandler(ngx_event_t* ev) {
 void NgxConnection::IdleReadHandler(ngx_event_t* ev) {
   ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
   NgxConnection* nc = static_cast<NgxConnection*>(c->data);
-
-  if (c->read->timedout) {
-    nc->set_keepalive(false);
-    nc->Close();
-    return;
-  }
-
   char buf[1];
   int n;
 
@@ -273,17 +305,26 @@ NgxFetch::NgxFetch(const GoogleString& url,
       done_(false),
       content_length_(-1),
       content_length_known_(false),
-      resolver_ctx_(NULL) {
+      socklen_(0),
+      peer_(NULL),
+      resolver_ctx_(NULL),
+      timeout_deadline_ms_(0),
+      timeout_prev_(NULL),
+      timeout_next_(NULL),
+      timeout_linked_(false) {
   ngx_memzero(&url_, sizeof(url_));
   log_ = log;
   pool_ = NULL;
-  timeout_event_ = NULL;
   connection_ = NULL;
 }
 
 NgxFetch::~NgxFetch() {
-  if (timeout_event_ != NULL && timeout_event_->timer_set) {
-    ngx_del_timer(timeout_event_);
+  if (timeout_linked_) {
+    fetcher_->CancelFetchTimeout(this);
+  }
+  if (peer_ != NULL) {
+    fetcher_->origins_->ReleasePeer(peer_);
+    peer_ = NULL;
   }
   if (connection_ != NULL) {
     connection_->Close();
@@ -324,19 +365,7 @@ bool NgxFetch::Init() {
     return false;
   }
 
-  timeout_event_ = static_cast<ngx_event_t*>(
-      ngx_pcalloc(pool_, sizeof(ngx_event_t)));
-  if (timeout_event_ == NULL) {
-    message_handler_->Message(kError,
-                              "NgxFetch: ngx_pcalloc failed for timeout");
-    return false;
-  }
-
-  timeout_event_->data = this;
-  timeout_event_->handler = NgxFetch::TimeoutHandler;
-  timeout_event_->log = log_;
-
-  ngx_add_timer(timeout_event_, fetcher_->fetch_timeout_);
+  fetcher_->AddFetchTimeout(this);
   r_ = static_cast<ngx_http_request_t*>(
       ngx_pcalloc(pool_, sizeof(ngx_http_request_t)));
 
@@ -354,6 +383,21 @@ bool NgxFetch::Init() {
     return false;
   }
 
+  // Origins mapped to a unix domain socket or an upstream{} block are
+  // connected to directly, without going through a proxy or the resolver.
+  if (fetcher_->origins_ != NULL) {
+    peer_ = fetcher_->origins_->SelectPeer(url_.host, url_.port);
+    if (peer_ != NULL) {
+      ngx_memcpy(sockaddr_, peer_->sockaddr, peer_->socklen);
+      socklen_ = peer_->socklen;
+      if (InitRequest() != NGX_OK) {
+        message_handler()->Message(kError, "NgxFetch: InitRequest failed");
+        return false;
+      }
+      return true;
+    }
+  }
+
   // The host is either a domain name or an IP address.  First check
   // if it's a valid IP address and only if that fails fall back to
   // using the DNS resolver.
@@ -366,12 +410,14 @@ bool NgxFetch::Init() {
 
   GoogleString s_ipaddress(reinterpret_cast<char*>(tmp_url->host.data),
                            tmp_url->host.len);
-  ngx_memzero(&sin_, sizeof(sin_));
-  sin_.sin_family = AF_INET;
-  sin_.sin_port = htons(tmp_url->port);
-  sin_.sin_addr.s_addr = inet_addr(s_ipaddress.c_str());
-
-  if (sin_.sin_addr.s_addr == INADDR_NONE) {
+  struct sockaddr_in* sin = reinterpret_cast<struct sockaddr_in*>(sockaddr_);
+  socklen_ = sizeof(struct sockaddr_in);
+  ngx_memzero(sin, socklen_);
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(tmp_url->port);
+  sin->sin_addr.s_addr = inet_addr(s_ipaddress.c_str());
+
+  if (sin->sin_addr.s_addr == INADDR_NONE) {
     // inet_addr returned INADDR_NONE, which means the hostname
     // isn't a valid IP address.  Check DNS.
     ngx_resolver_ctx_t temp;
@@ -436,9 +482,13 @@ void NgxFetch::CallbackDone(bool success) {
 
   release_resolver();
 
-  if (timeout_event_ && timeout_event_->timer_set) {
-    ngx_del_timer(timeout_event_);
-    timeout_event_ = NULL;
+  if (timeout_linked_) {
+    fetcher_->CancelFetchTimeout(this);
+  }
+
+  if (peer_ != NULL) {
+    fetcher_->origins_->ReleasePeer(peer_);
+    peer_ = NULL;
   }
 
   if (connection_ != NULL) {
@@ -526,10 +576,6 @@ void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
   NgxUrlAsyncFetcher* fetcher = fetch->fetcher_;
 
   if (resolver_ctx->state != NGX_OK) {
-    if (fetch->timeout_event() != NULL && fetch->timeout_event()->timer_set) {
-      ngx_del_timer(fetch->timeout_event());
-      fetch->set_timeout_event(NULL);
-    }
     fetch->message_handler()->Message(
         kWarning, "NgxFetch %p: failed to resolve host [%.*s]", fetch,
         static_cast<int>(resolver_ctx->name.len), resolver_ctx->name.data);
@@ -556,39 +602,39 @@ void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
 
   // If no suitable ipv4 address was found, we fail.
   if (i == resolver_ctx->naddrs) {
-    if (fetch->timeout_event() != NULL && fetch->timeout_event()->timer_set) {
-      ngx_del_timer(fetch->timeout_event());
-      fetch->set_timeout_event(NULL);
-    }
     fetch->message_handler()->Message(
         kWarning, "NgxFetch %p: no suitable address for host [%.*s]", fetch,
         static_cast<int>(resolver_ctx->name.len), resolver_ctx->name.data);
     fetch->CallbackDone(false);
+    return;
   }
 
-  ngx_memzero(&fetch->sin_, sizeof(fetch->sin_));
+  struct sockaddr_in* fetch_sin =
+      reinterpret_cast<struct sockaddr_in*>(fetch->sockaddr_);
+  fetch->socklen_ = sizeof(struct sockaddr_in);
+  ngx_memzero(fetch_sin, fetch->socklen_);
 
 #if (nginx_version < 1005008)
-  fetch->sin_.sin_addr.s_addr = resolver_ctx->addrs[i];
+  fetch_sin->sin_addr.s_addr = resolver_ctx->addrs[i];
 #else
   struct sockaddr_in* sin;
 
   sin = reinterpret_cast<struct sockaddr_in*>(
       resolver_ctx->addrs[i].sockaddr);
 
-  fetch->sin_.sin_family = sin->sin_family;
-  fetch->sin_.sin_addr.s_addr = sin->sin_addr.s_addr;
+  fetch_sin->sin_family = sin->sin_family;
+  fetch_sin->sin_addr.s_addr = sin->sin_addr.s_addr;
 #endif
 
-  fetch->sin_.sin_family = AF_INET;
-  fetch->sin_.sin_port = htons(fetch->url_.port);
+  fetch_sin->sin_family = AF_INET;
+  fetch_sin->sin_port = htons(fetch->url_.port);
 
   // Maybe we have Proxy
   if (0 != fetcher->proxy_.url.len) {
-    fetch->sin_.sin_port = htons(fetcher->proxy_.port);
+    fetch_sin->sin_port = htons(fetcher->proxy_.port);
   }
 
-  char* ip_address = inet_ntoa(fetch->sin_.sin_addr);
+  char* ip_address = inet_ntoa(fetch_sin->sin_addr);
 
   ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
                 "NgxFetch %p: Resolved host [%V] to [%s]", fetch,
@@ -695,8 +741,8 @@ int NgxFetch::InitRequest() {
 int NgxFetch::Connect() {
   ngx_peer_connection_t pc;
   ngx_memzero(&pc, sizeof(pc));
-  pc.sockaddr = (struct sockaddr*)&sin_;
-  pc.socklen = sizeof(struct sockaddr_in);
+  pc.sockaddr = reinterpret_cast<struct sockaddr*>(sockaddr_);
+  pc.socklen = socklen_;
   pc.name = &url_.host;
 
   // get callback is dummy function, it just returns NGX_OK
@@ -720,12 +766,12 @@ int NgxFetch::Connect() {
   connection_->c_->read->handler = NgxFetch::ConnectionReadHandler;
   connection_->c_->data = this;
 
-  // Timer set in Init() is still in effect.
+  // Timeout set in Init() is still in effect.
   return NGX_OK;
 }
 
 // When the fetch sends the request completely, it will hook the read event,
-// and prepare to parse the response. Timer set in Init() is still in effect.
+// and prepare to parse the response. Timeout set in Init() is still in effect.
 void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
   ngx_connection_t* c = static_cast<ngx_connection_t*>(wev->data);
   NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
@@ -763,7 +809,7 @@ void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
   }
 }
 
-// Timer set in Init() is still in effect.
+// Timeout set in Init() is still in effect.
 void NgxFetch::ConnectionReadHandler(ngx_event_t* rev) {
   ngx_connection_t* c = static_cast<ngx_connection_t*>(rev->data);
   NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
@@ -916,13 +962,6 @@ bool NgxFetch::HandleBody(ngx_connection_t* c) {
   return true;
 }
 
-void NgxFetch::TimeoutHandler(ngx_event_t* tev) {
-  NgxFetch* fetch = static_cast<NgxFetch*>(tev->data);
-  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
-                "NgxFetch %p: TimeoutHandler called", fetch);
-  fetch->CallbackDone(false);
-}
-
 void NgxFetch::FixUserAgent() {
   GoogleString user_agent;
   ConstStringStarVector v;
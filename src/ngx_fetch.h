@@ -57,6 +57,7 @@ typedef bool (*response_handler_pt)(ngx_connection_t* c);
 
 class NgxUrlAsyncFetcher;
 class NgxConnection;
+struct NgxFetchPeer;
 
 class NgxConnection : public PoolElement<NgxConnection> {
  public:
@@ -82,11 +83,15 @@ class NgxConnection : public PoolElement<NgxConnection> {
                                 int max_keepalive_requests);
   static void IdleWriteHandler(ngx_event_t* ev);
   static void IdleReadHandler(ngx_event_t* ev);
+  // Closes pooled connections that have been idle for longer than
+  // keepalive_timeout_ms.  A single timer serves the whole pool.
+  static void IdleSweepHandler(ngx_event_t* ev);
   // Terminate will cleanup any idle connections upon shutdown.
   static void Terminate();
 
   static NgxConnectionPool connection_pool;
   static PthreadMutex connection_pool_mutex;
+  static ngx_event_t idle_sweep_event;
 
   // c_ is owned by NgxConnection and freed in ::Close()
   ngx_connection_t* c_;
@@ -96,6 +101,8 @@ class NgxConnection : public PoolElement<NgxConnection> {
  private:
   int max_keepalive_requests_;
   bool keepalive_;
+  // When this connection will be closed if it is still sitting in the pool.
+  ngx_msec_t idle_deadline_ms_;
   socklen_t socklen_;
   u_char sockaddr_[NGX_SOCKADDRLEN];
   MessageHandler* handler_;
@@ -137,12 +144,6 @@ class NgxFetch : public PoolElement<NgxFetch> {
   int get_status_code() {
     return static_cast<int>(status_->code);
   }
-  ngx_event_t* timeout_event() {
-    return timeout_event_;
-  }
-  void set_timeout_event(ngx_event_t* x) {
-    timeout_event_ = x;
-  }
   void release_resolver() {
     if (resolver_ctx_ != NULL && resolver_ctx_ != NGX_NO_RESOLVER) {
       ngx_resolve_name_done(resolver_ctx_);
@@ -174,8 +175,6 @@ class NgxFetch : public PoolElement<NgxFetch> {
   static bool HandleHeader(ngx_connection_t* c);
   // Read the response body.
   static bool HandleBody(ngx_connection_t* c);
-  // Cancel the fetch when it's timeout.
-  static void TimeoutHandler(ngx_event_t* tev);
 
   // Add the pagespeed User-Agent.
   void FixUserAgent();
@@ -194,17 +193,29 @@ class NgxFetch : public PoolElement<NgxFetch> {
   int64 content_length_;
   bool content_length_known_;
 
-  struct sockaddr_in sin_;
+  // Address we connect to: the resolved origin or proxy, or a peer from the
+  // fetcher's origin map.
+  u_char sockaddr_[NGX_SOCKADDRLEN];
+  socklen_t socklen_;
+  NgxFetchPeer* peer_;
   ngx_log_t* log_;
   ngx_buf_t* out_;
   ngx_buf_t* in_;
   ngx_pool_t* pool_;
   ngx_http_request_t* r_;
   ngx_http_status_t* status_;
-  ngx_event_t* timeout_event_;
   NgxConnection* connection_;
   ngx_resolver_ctx_t* resolver_ctx_;
 
+  // Links in the fetcher's deadline-ordered list of pending timeouts, see
+  // NgxUrlAsyncFetcher::AddFetchTimeout().
+  ngx_msec_t timeout_deadline_ms_;
+  NgxFetch* timeout_prev_;
+  NgxFetch* timeout_next_;
+  bool timeout_linked_;
+
+  friend class NgxUrlAsyncFetcher;
+
   DISALLOW_COPY_AND_ASSIGN(NgxFetch);
 };
 
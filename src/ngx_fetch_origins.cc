@@ -0,0 +1,254 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+#include "ngx_fetch_origins.h"
+
+extern "C" {
+#if (NGX_HAVE_UNIX_DOMAIN)
+#include <sys/un.h>
+#endif
+}
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/stl_util.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kUnixPrefix[] = "unix:";
+const char kUpstreamPrefix[] = "upstream:";
+
+}  // namespace
+
+NgxFetchOrigins::NgxFetchOrigins() : initialized_(false) {
+}
+
+NgxFetchOrigins::~NgxFetchOrigins() {
+  for (int i = 0, n = origins_.size(); i < n; ++i) {
+    STLDeleteElements(&origins_[i]->peers);
+  }
+  STLDeleteElements(&origins_);
+}
+
+NgxFetchPeer* NgxFetchOrigins::NewPeer(const struct sockaddr* sockaddr,
+                                       socklen_t socklen, int weight) {
+  NgxFetchPeer* peer = new NgxFetchPeer;
+  CHECK_LE(static_cast<size_t>(socklen), sizeof(peer->sockaddr));
+  ngx_memcpy(peer->sockaddr, sockaddr, socklen);
+  peer->socklen = socklen;
+  peer->weight = weight > 0 ? weight : 1;
+  peer->active = 0;
+  return peer;
+}
+
+bool NgxFetchOrigins::Add(StringPiece domain, StringPiece target,
+                          StringPiece balancing, GoogleString* error) {
+  scoped_ptr<Origin> origin(new Origin);
+  origin->port = 80;
+  origin->next = 0;
+
+  StringPiece host = domain;
+  size_t colon = domain.rfind(':');
+  if (colon != StringPiece::npos) {
+    int port;
+    if (!StringToInt(domain.substr(colon + 1), &port) ||
+        port <= 0 || port > 65535) {
+      *error = "invalid port";
+      return false;
+    }
+    origin->port = static_cast<in_port_t>(port);
+    host = domain.substr(0, colon);
+  }
+  if (host.empty()) {
+    *error = "empty domain";
+    return false;
+  }
+  origin->host = host.as_string();
+  LowerString(&origin->host);
+
+  if (balancing.empty() || StringCaseEqual(balancing, "round_robin")) {
+    origin->balancing = kRoundRobin;
+  } else if (StringCaseEqual(balancing, "least_conn")) {
+    origin->balancing = kLeastConn;
+  } else {
+    *error = "balancing must be round_robin or least_conn";
+    return false;
+  }
+
+  if (StringCaseStartsWith(target, kUnixPrefix)) {
+#if (NGX_HAVE_UNIX_DOMAIN)
+    StringPiece path = target.substr(STATIC_STRLEN(kUnixPrefix));
+    struct sockaddr_un sun;
+    if (path.empty() || path.size() >= sizeof(sun.sun_path)) {
+      *error = "invalid unix domain socket path";
+      return false;
+    }
+    ngx_memzero(&sun, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    ngx_memcpy(sun.sun_path, path.data(), path.size());
+    origin->peers.push_back(NewPeer(
+        reinterpret_cast<struct sockaddr*>(&sun), sizeof(sun), 1));
+#else
+    *error = "unix domain sockets are not supported on this platform";
+    return false;
+#endif
+  } else if (StringCaseStartsWith(target, kUpstreamPrefix)) {
+    StringPiece name = target.substr(STATIC_STRLEN(kUpstreamPrefix));
+    if (name.empty()) {
+      *error = "missing upstream name";
+      return false;
+    }
+    // Upstream blocks may come later in the configuration, so we resolve the
+    // name in Init().
+    origin->upstream = name.as_string();
+  } else {
+    *error = "target must start with unix: or upstream:";
+    return false;
+  }
+
+  for (int i = 0, n = origins_.size(); i < n; ++i) {
+    if (origins_[i]->host == origin->host &&
+        origins_[i]->port == origin->port) {
+      *error = "domain is already mapped";
+      STLDeleteElements(&origin->peers);
+      return false;
+    }
+  }
+  origins_.push_back(origin.release());
+  return true;
+}
+
+bool NgxFetchOrigins::Init(ngx_cycle_t* cycle, MessageHandler* handler) {
+  if (initialized_) {
+    return true;
+  }
+  initialized_ = true;
+
+  bool ok = true;
+  for (int i = 0, n = origins_.size(); i < n; ++i) {
+    if (!origins_[i]->upstream.empty() &&
+        !AddUpstreamPeers(cycle, origins_[i], handler)) {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool NgxFetchOrigins::AddUpstreamPeers(ngx_cycle_t* cycle, Origin* origin,
+                                       MessageHandler* handler) {
+  ngx_http_upstream_main_conf_t* umcf =
+      static_cast<ngx_http_upstream_main_conf_t*>(
+          ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module));
+  if (umcf == NULL) {
+    handler->Message(kError, "NativeFetcherOrigin: no upstream configuration");
+    return false;
+  }
+
+  ngx_http_upstream_srv_conf_t** uscfp =
+      static_cast<ngx_http_upstream_srv_conf_t**>(umcf->upstreams.elts);
+  for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+    ngx_http_upstream_srv_conf_t* uscf = uscfp[i];
+    // Upstreams implicitly created by proxy_pass have no server list.
+    if (uscf->servers == NULL ||
+        !StringCaseEqual(origin->upstream, StringPiece(
+            reinterpret_cast<char*>(uscf->host.data), uscf->host.len))) {
+      continue;
+    }
+    ngx_http_upstream_server_t* servers =
+        static_cast<ngx_http_upstream_server_t*>(uscf->servers->elts);
+    for (ngx_uint_t j = 0; j < uscf->servers->nelts; j++) {
+      if (servers[j].backup || servers[j].down) {
+        continue;
+      }
+      for (ngx_uint_t k = 0; k < servers[j].naddrs; k++) {
+        origin->peers.push_back(NewPeer(servers[j].addrs[k].sockaddr,
+                                        servers[j].addrs[k].socklen,
+                                        servers[j].weight));
+      }
+    }
+    break;
+  }
+
+  if (origin->peers.empty()) {
+    handler->Message(kError,
+                     "NativeFetcherOrigin: upstream \"%s\" for %s:%d not found "
+                     "or has no usable servers", origin->upstream.c_str(),
+                     origin->host.c_str(), static_cast<int>(origin->port));
+    return false;
+  }
+  return true;
+}
+
+NgxFetchPeer* NgxFetchOrigins::SelectPeer(const ngx_str_t& host,
+                                          in_port_t port) {
+  StringPiece host_piece(reinterpret_cast<char*>(host.data), host.len);
+  Origin* origin = NULL;
+  for (int i = 0, n = origins_.size(); i < n; ++i) {
+    if (origins_[i]->port == port &&
+        StringCaseEqual(origins_[i]->host, host_piece)) {
+      origin = origins_[i];
+      break;
+    }
+  }
+  if (origin == NULL || origin->peers.empty()) {
+    return NULL;
+  }
+
+  NgxFetchPeer* peer = NULL;
+  int num_peers = origin->peers.size();
+  if (origin->balancing == kLeastConn) {
+    // Compare active / weight without dividing.
+    for (int i = 0; i < num_peers; ++i) {
+      NgxFetchPeer* candidate = origin->peers[i];
+      if (peer == NULL ||
+          candidate->active * peer->weight < peer->active * candidate->weight) {
+        peer = candidate;
+      }
+    }
+  } else {
+    int total_weight = 0;
+    for (int i = 0; i < num_peers; ++i) {
+      total_weight += origin->peers[i]->weight;
+    }
+    int slot = origin->next % total_weight;
+    origin->next = slot + 1;
+    for (int i = 0; i < num_peers; ++i) {
+      slot -= origin->peers[i]->weight;
+      if (slot < 0) {
+        peer = origin->peers[i];
+        break;
+      }
+    }
+  }
+
+  DCHECK(peer != NULL);
+  ++peer->active;
+  return peer;
+}
+
+void NgxFetchOrigins::ReleasePeer(NgxFetchPeer* peer) {
+  DCHECK_GT(peer->active, 0);
+  --peer->active;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,113 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Lets the native fetcher reach selected origins without DNS: a domain can be
+// mapped to a local unix domain socket, or to the servers of an nginx
+// upstream{} block, balanced round robin or by least active connections.
+// For example:
+//
+//   pagespeed NativeFetcherOrigin www.example.com unix:/run/app.sock;
+//   pagespeed NativeFetcherOrigin static.example.com:8080 upstream:statics
+//       least_conn;
+
+#ifndef NGX_FETCH_ORIGINS_H_
+#define NGX_FETCH_ORIGINS_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class MessageHandler;
+
+// One address an origin can be fetched from.  Peers are owned by
+// NgxFetchOrigins and live as long as it does.
+struct NgxFetchPeer {
+  u_char sockaddr[NGX_SOCKADDRLEN];
+  socklen_t socklen;
+  int weight;
+  // Fetches currently using this peer, for least_conn balancing.
+  int active;
+};
+
+class NgxFetchOrigins {
+ public:
+  NgxFetchOrigins();
+  ~NgxFetchOrigins();
+
+  // Maps domain, "host" or "host:port", to target, which is either
+  // "unix:/path/to/socket" or "upstream:name".  balancing may be empty,
+  // "round_robin" or "least_conn".  Called at configuration time; on failure
+  // returns false and sets *error.
+  bool Add(StringPiece domain, StringPiece target, StringPiece balancing,
+           GoogleString* error);
+
+  bool empty() const { return origins_.empty(); }
+
+  // Looks up the upstream{} blocks named by mappings.  Needs the complete http
+  // configuration, so it is called from the worker process.  Only the first
+  // call does any work.
+  bool Init(ngx_cycle_t* cycle, MessageHandler* handler);
+
+  // Returns the peer to use for a fetch from host:port, or NULL if that origin
+  // is not mapped.  A returned peer must be handed back to ReleasePeer() when
+  // the fetch is done.  Only called from the nginx thread.
+  NgxFetchPeer* SelectPeer(const ngx_str_t& host, in_port_t port);
+  void ReleasePeer(NgxFetchPeer* peer);
+
+ private:
+  enum Balancing {
+    kRoundRobin,
+    kLeastConn
+  };
+
+  struct Origin {
+    GoogleString host;
+    in_port_t port;
+    GoogleString upstream;  // Empty for unix domain sockets.
+    Balancing balancing;
+    std::vector<NgxFetchPeer*> peers;
+    // Round robin position, counted in units of weight.
+    int next;
+  };
+
+  bool AddUpstreamPeers(ngx_cycle_t* cycle, Origin* origin,
+                        MessageHandler* handler);
+  static NgxFetchPeer* NewPeer(const struct sockaddr* sockaddr,
+                               socklen_t socklen, int weight);
+
+  std::vector<Origin*> origins_;
+  bool initialized_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxFetchOrigins);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_FETCH_ORIGINS_H_
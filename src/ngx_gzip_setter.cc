@@ -281,6 +281,16 @@ ngx_str_t gzip_http_types[] = {
   ngx_null_string  // Indicates end of array.
 };
 
+bool NgxGZipSetter::GZipOnForRequest(ngx_http_request_t* r) {
+  if (gzip_command_.command_ == NULL) {
+    return false;
+  }
+  char* conf = reinterpret_cast<char*>(
+      ngx_http_get_module_loc_conf(r, (*(gzip_command_.module_))));
+  return *reinterpret_cast<ngx_flag_t*>(
+      conf + gzip_command_.command_->offset) == 1;
+}
+
 gzs_enable_result NgxGZipSetter::SetGZipForLocation(ngx_conf_t* cf,
                                                     bool value) {
   if (!enabled_) {
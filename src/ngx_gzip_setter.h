@@ -113,6 +113,8 @@ class NgxGZipSetter {
   gzs_enable_result SetGZipForLocation(ngx_conf_t* cf, bool value);
   void AddGZipHTTPTypes(ngx_conf_t* cf);
   void RollBackAndDisable(ngx_conf_t* cf);
+  // Whether "gzip on" is in effect for r's location.
+  bool GZipOnForRequest(ngx_http_request_t* r);
 
   bool enabled() { return enabled_; }
 
@@ -0,0 +1,172 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "ngx_output_compressor.h"
+
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kHtmlCompressionInputBytes[] = "html_compression_input_bytes";
+const char kHtmlCompressionOutputBytes[] = "html_compression_output_bytes";
+const char kHtmlCompressionTimeUs[] = "html_compression_time_us";
+
+// Enough to keep one compressor per response a busy worker has in flight at
+// once without holding on to much memory after a spike.
+const size_t kMaxIdleCompressors = 8;
+
+// Compressors waiting for reuse.  Only touched on the nginx thread.
+std::vector<NgxOutputCompressor*> idle_compressors;
+
+}  // namespace
+
+NgxOutputCompressor::NgxOutputCompressor(int level, int window_bits)
+    : level_(level),
+      window_bits_(window_bits),
+      initialized_(false),
+      timer_(NULL),
+      handler_(NULL),
+      input_bytes_(NULL),
+      output_bytes_(NULL),
+      time_us_(NULL) {
+}
+
+NgxOutputCompressor::~NgxOutputCompressor() {
+#if (NGX_ZLIB)
+  if (initialized_) {
+    deflateEnd(&stream_);
+  }
+#endif
+}
+
+void NgxOutputCompressor::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kHtmlCompressionInputBytes);
+  statistics->AddVariable(kHtmlCompressionOutputBytes);
+  statistics->AddVariable(kHtmlCompressionTimeUs);
+}
+
+bool NgxOutputCompressor::Init() {
+#if (NGX_ZLIB)
+  memset(&stream_, 0, sizeof(stream_));
+  // Adding 16 to the window bits asks zlib for a gzip wrapper.
+  initialized_ = deflateInit2(&stream_, level_, Z_DEFLATED, window_bits_ + 16,
+                              8 /* memLevel */, Z_DEFAULT_STRATEGY) == Z_OK;
+#endif
+  return initialized_;
+}
+
+NgxOutputCompressor* NgxOutputCompressor::Acquire(int level, int window_bits,
+                                                  Statistics* statistics,
+                                                  Timer* timer,
+                                                  MessageHandler* handler) {
+  NgxOutputCompressor* compressor = NULL;
+  for (size_t i = 0; i < idle_compressors.size(); ++i) {
+    if (idle_compressors[i]->level_ == level &&
+        idle_compressors[i]->window_bits_ == window_bits) {
+      compressor = idle_compressors[i];
+      idle_compressors[i] = idle_compressors.back();
+      idle_compressors.pop_back();
+      break;
+    }
+  }
+
+  if (compressor == NULL) {
+    compressor = new NgxOutputCompressor(level, window_bits);
+    if (!compressor->Init()) {
+      handler->Message(kWarning,
+                       "Can't compress html with level %d and window bits %d",
+                       level, window_bits);
+      delete compressor;
+      return NULL;
+    }
+  }
+
+  compressor->timer_ = timer;
+  compressor->handler_ = handler;
+  compressor->input_bytes_ =
+      statistics->GetVariable(kHtmlCompressionInputBytes);
+  compressor->output_bytes_ =
+      statistics->GetVariable(kHtmlCompressionOutputBytes);
+  compressor->time_us_ = statistics->GetVariable(kHtmlCompressionTimeUs);
+  return compressor;
+}
+
+void NgxOutputCompressor::Release(NgxOutputCompressor* compressor) {
+#if (NGX_ZLIB)
+  if (idle_compressors.size() < kMaxIdleCompressors &&
+      deflateReset(&compressor->stream_) == Z_OK) {
+    idle_compressors.push_back(compressor);
+    return;
+  }
+#endif
+  delete compressor;
+}
+
+void NgxOutputCompressor::Terminate() {
+  for (size_t i = 0; i < idle_compressors.size(); ++i) {
+    delete idle_compressors[i];
+  }
+  idle_compressors.clear();
+}
+
+bool NgxOutputCompressor::Compress(StringPiece in, bool flush, bool finish,
+                                   GoogleString* out) {
+#if (NGX_ZLIB)
+  DCHECK(initialized_);
+  int64 start_us = timer_->NowUs();
+  size_t out_start = out->size();
+
+  stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  stream_.avail_in = in.size();
+  int mode = finish ? Z_FINISH : (flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+
+  // deflateBound() covers the whole input in one pass; the extra room is for
+  // the sync flush marker and the gzip trailer.  Keep going if it's short.
+  size_t chunk_size = deflateBound(&stream_, in.size()) + 32;
+  int rc;
+  do {
+    size_t used = out->size();
+    out->resize(used + chunk_size);
+    stream_.next_out = reinterpret_cast<Bytef*>(&(*out)[used]);
+    stream_.avail_out = chunk_size;
+    rc = deflate(&stream_, mode);
+    out->resize(used + chunk_size - stream_.avail_out);
+    if (rc == Z_STREAM_ERROR) {
+      handler_->Message(kError, "deflate() failed compressing html");
+      return false;
+    }
+  } while (stream_.avail_out == 0);
+
+  input_bytes_->Add(in.size());
+  output_bytes_->Add(out->size() - out_start);
+  time_us_->Add(timer_->NowUs() - start_us);
+  return true;
+#else
+  return false;
+#endif
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,104 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Gzips html we rewrote on its way out to the client.  Without this, html that
+// arrives gzipped is inflated for rewriting and then compressed again by
+// nginx's gzip filter at gzip_comp_level, a level usually picked for static
+// files.  With HtmlCompressionLevel set we compress the rewritten html
+// ourselves, a collected block at a time, and the gzip filter leaves the
+// already encoded response alone.
+//
+// Compressors are only used on the nginx thread.  Each worker keeps the ones
+// finished responses hand back, since setting up a deflate stream allocates
+// a few hundred kilobytes.
+
+#ifndef NGX_OUTPUT_COMPRESSOR_H_
+#define NGX_OUTPUT_COMPRESSOR_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class MessageHandler;
+class Statistics;
+class Timer;
+class Variable;
+
+class NgxOutputCompressor {
+ public:
+  ~NgxOutputCompressor();
+
+  static void InitStats(Statistics* statistics);
+
+  // Returns a compressor at the start of a new gzip stream, or NULL if nginx
+  // was built without zlib or zlib rejects the settings.  level is 1-9 and
+  // window_bits 9-15, as for deflateInit2().
+  static NgxOutputCompressor* Acquire(int level, int window_bits,
+                                      Statistics* statistics, Timer* timer,
+                                      MessageHandler* handler);
+
+  // Takes back a compressor from Acquire(), whether or not its stream was
+  // finished, so a later response can reuse it.
+  static void Release(NgxOutputCompressor* compressor);
+
+  // Frees the compressors waiting for reuse.  Called when the worker exits.
+  static void Terminate();
+
+  // Appends the compressed form of in to out.  If flush, everything given so
+  // far can be decoded from the output; if finish, the gzip stream is ended.
+  // Returns false if zlib failed, after which the output is unusable.
+  bool Compress(StringPiece in, bool flush, bool finish, GoogleString* out);
+
+ private:
+  NgxOutputCompressor(int level, int window_bits);
+
+  bool Init();
+
+  int level_;
+  int window_bits_;
+#if (NGX_ZLIB)
+  z_stream stream_;
+#endif
+  bool initialized_;
+
+  // Set by Acquire() for the response using this compressor.
+  Timer* timer_;
+  MessageHandler* handler_;
+  Variable* input_bytes_;
+  Variable* output_bytes_;
+  Variable* time_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxOutputCompressor);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_OUTPUT_COMPRESSOR_H_
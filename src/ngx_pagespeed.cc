@@ -28,6 +28,7 @@
 
 #include "ngx_pagespeed.h"
 
+#include <algorithm>
 #include <vector>
 #include <set>
 
@@ -36,9 +37,13 @@
 #include "ngx_gzip_setter.h"
 #include "ngx_list_iterator.h"
 #include "ngx_message_handler.h"
+#include "ngx_output_compressor.h"
+#include "ngx_recording_file_reader.h"
+#include "ngx_request_timing.h"
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
+#include "ngx_shared_hash_table.h"
 
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/cache_url_async_fetcher.h"
@@ -56,10 +61,9 @@
 #include "net/instaweb/rewriter/public/static_asset_manager.h"
 #include "net/instaweb/util/public/fallback_property_page.h"
 #include "pagespeed/automatic/proxy_fetch.h"
+#include "pagespeed/kernel/base/function.h"
 #include "pagespeed/kernel/base/google_message_handler.h"
 #include "pagespeed/kernel/base/null_message_handler.h"
-#include "pagespeed/kernel/base/posix_timer.h"
-#include "pagespeed/kernel/base/stack_buffer.h"
 #include "pagespeed/kernel/base/stdio_file_system.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_writer.h"
@@ -83,7 +87,6 @@ extern ngx_module_t ngx_pagespeed;
 // Unused flag, see
 // http://lxr.evanmiller.org/http/source/http/ngx_http_request.h#L130
 #define  NGX_HTTP_PAGESPEED_BUFFERED 0x08
-#define  POST_BUF_READ_SIZE 65536
 
 // Needed for SystemRewriteDriverFactory to use shared memory.
 #define PAGESPEED_SUPPORT_POSIX_SHARED_MEM
@@ -94,6 +97,13 @@ net_instaweb::NgxRewriteDriverFactory* active_driver_factory = NULL;
 namespace net_instaweb {
 
 const char* kInternalEtagName = "@psol-etag";
+// How many IPRO recordings all workers together keep track of, and how long
+// a worker's claim on one lasts if it never releases it, for example because
+// the worker died mid-recording.
+const ngx_uint_t kIproRecordingSlots = 4096;
+const ngx_uint_t kIproNegativeLookupSlots = 16384;
+const ngx_uint_t kBeaconRateLimitSlots = 16384;
+const int64 kIproRecordingClaimMs = 60 * 1000;
 // The process context takes care of proactively initialising
 // a few libraries for us, some of which are not thread-safe
 // when they are initialized lazily.
@@ -212,6 +222,39 @@ ngx_int_t string_piece_to_buffer_chain(
   return NGX_OK;
 }
 
+// Like string_piece_to_buffer_chain, but instead of copying sp, the single
+// buffer in the chain points at it, marked read-only.  Use this for data that
+// outlives the request, like the contents of the static asset manager.  Always
+// sends last_buf.
+ngx_int_t string_piece_to_shared_buffer_chain(
+    ngx_pool_t* pool, StringPiece sp, ngx_chain_t** link_ptr) {
+  *link_ptr = NULL;
+
+  ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(pool));
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (sp.size() == 0) {
+    // The purpose of this buffer is just to pass along last_buf.
+    b->sync = 1;
+  } else {
+    b->start = b->pos = reinterpret_cast<u_char*>(const_cast<char*>(sp.data()));
+    b->end = b->last = b->pos + sp.size();
+    b->memory = 1;  // In-memory, but other filters must not modify it.
+  }
+  b->last_buf = 1;
+
+  ngx_chain_t* cl = static_cast<ngx_chain_t*>(ngx_alloc_chain_link(pool));
+  if (cl == NULL) {
+    return NGX_ERROR;
+  }
+  cl->buf = b;
+  cl->next = NULL;
+  *link_ptr = cl;
+  return NGX_OK;
+}
+
 // Get the context for this request.  ps_connection_read_handler should already
 // have been called to create it.
 ps_request_ctx_t* ps_get_request_context(ngx_http_request_t* r) {
@@ -326,7 +369,10 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
       ngx_http_clean_header(r);
     }
     // collect response headers from pagespeed
-    rc = ctx->base_fetch->CollectHeaders(&r->headers_out);
+    {
+      NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kHeaderExport);
+      rc = ctx->base_fetch->CollectHeaders(&r->headers_out);
+    }
     if (rc == NGX_ERROR) {
       ps_release_base_fetch(ctx);
       return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -356,7 +402,10 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
   // whole file in one chain buffers is too aggressive. It could consume
   // too much memory in busy servers.
 
-  rc = ctx->base_fetch->CollectAccumulatedWrites(&cl);
+  {
+    NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kCollectWrites);
+    rc = ctx->base_fetch->CollectAccumulatedWrites(&cl);
+  }
   ngx_log_error(NGX_LOG_DEBUG, ctx->r->connection->log, 0,
                 "CollectAccumulatedWrites, %d", rc);
 
@@ -505,6 +554,13 @@ bool ps_get_cache_control(ngx_http_request_t* r, GoogleString* cache_control) {
   return true;
 }
 
+// The time nginx cached at the top of this event loop iteration.  Good enough
+// for the headers we synthesize, and cheaper than asking the system clock.
+int64 ps_cached_now_ms() {
+  ngx_time_t* tp = ngx_timeofday();
+  return static_cast<int64>(tp->sec) * 1000 + tp->msec;
+}
+
 template<class Headers>
 void copy_headers_from_table(const ngx_list_t &from, Headers* to) {
   // Standard nginx idiom for iterating over a list.  See ngx_list.h
@@ -532,10 +588,111 @@ void copy_headers_from_table(const ngx_list_t &from, Headers* to) {
     to->Add(key, value);
   }
 }
-}  // namespace
 
-void copy_response_headers_from_ngx(const ngx_http_request_t* r,
-                                    ResponseHeaders* headers) {
+// What copy_response_headers_to_ngx needs to do with a response header.
+enum ResponseHeaderKind {
+  kCacheControlHeader,
+  kContentTypeHeader,
+  kHopByHopHeader,
+  kVaryHeader,
+  kDateHeader,
+  kEtagHeader,
+  kExpiresHeader,
+  kLastModifiedHeader,
+  kLocationHeader,
+  kServerHeader,
+  kContentLengthHeader,
+  kContentEncodingHeader,
+  kRefreshHeader,
+  kContentRangeHeader,
+  kAcceptRangesHeader,
+  kWwwAuthenticateHeader,
+};
+
+struct ResponseHeaderInfo {
+  // Used as the header key, without copying, when PSOL spells it this way.
+  ngx_str_t name;
+  ResponseHeaderKind kind;
+  // Whether we leave this header alone for kPreserveAllCachingHeaders.
+  bool caching;
+};
+
+const ResponseHeaderInfo kResponseHeaderInfo[] = {
+  { ngx_string("Cache-Control"), kCacheControlHeader, true },
+  { ngx_string("Content-Type"), kContentTypeHeader, false },
+  { ngx_string("Connection"), kHopByHopHeader, false },
+  { ngx_string("Keep-Alive"), kHopByHopHeader, false },
+  { ngx_string("Transfer-Encoding"), kHopByHopHeader, false },
+  { ngx_string("Vary"), kVaryHeader, false },
+  { ngx_string("Date"), kDateHeader, true },
+  { ngx_string("Etag"), kEtagHeader, true },
+  { ngx_string("Expires"), kExpiresHeader, true },
+  { ngx_string("Last-Modified"), kLastModifiedHeader, true },
+  { ngx_string("Location"), kLocationHeader, false },
+  { ngx_string("Server"), kServerHeader, false },
+  { ngx_string("Content-Length"), kContentLengthHeader, false },
+  { ngx_string("Content-Encoding"), kContentEncodingHeader, false },
+  { ngx_string("Refresh"), kRefreshHeader, false },
+  { ngx_string("Content-Range"), kContentRangeHeader, false },
+  { ngx_string("Accept-Ranges"), kAcceptRangesHeader, false },
+  { ngx_string("WWW-Authenticate"), kWwwAuthenticateHeader, false },
+};
+
+// Maps a header name to its kResponseHeaderInfo entry with a single hashed
+// probe.  The hash only looks at the length and the last character, which is
+// enough to give each of the names above a slot of its own; if a new name
+// ever collides it lands in the next free slot and lookups still find it.
+class ResponseHeaderClassifier {
+ public:
+  ResponseHeaderClassifier() {
+    for (int i = 0; i < kNumSlots; ++i) {
+      slots_[i] = kEmptySlot;
+    }
+    for (int i = 0; i < static_cast<int>(arraysize(kResponseHeaderInfo));
+         ++i) {
+      int slot = Hash(str_to_string_piece(kResponseHeaderInfo[i].name));
+      while (slots_[slot] != kEmptySlot) {
+        slot = (slot + 1) % kNumSlots;
+      }
+      slots_[slot] = i;
+    }
+  }
+
+  // Returns NULL for headers we pass through without special handling.
+  const ResponseHeaderInfo* Lookup(StringPiece name) const {
+    if (name.empty()) {
+      return NULL;
+    }
+    for (int slot = Hash(name); slots_[slot] != kEmptySlot;
+         slot = (slot + 1) % kNumSlots) {
+      const ResponseHeaderInfo* info = &kResponseHeaderInfo[slots_[slot]];
+      if (StringCaseEqual(name, str_to_string_piece(info->name))) {
+        return info;
+      }
+    }
+    return NULL;
+  }
+
+ private:
+  static const int kNumSlots = 64;
+  static const int kEmptySlot = -1;
+
+  static int Hash(StringPiece name) {
+    int last = static_cast<unsigned char>(name[name.size() - 1]) | 0x20;
+    return static_cast<int>((name.size() * 6 + last) % kNumSlots);
+  }
+
+  int slots_[kNumSlots];
+
+  DISALLOW_COPY_AND_ASSIGN(ResponseHeaderClassifier);
+};
+
+const ResponseHeaderClassifier response_header_classifier;
+
+// Copies the response headers nginx has so far without synthesizing a Date or
+// computing caching, for callers that only look the headers over.
+void copy_response_header_fields_from_ngx(const ngx_http_request_t* r,
+                                          ResponseHeaders* headers) {
   headers->set_major_version(r->http_version / 1000);
   headers->set_minor_version(r->http_version % 1000);
   copy_headers_from_table(r->headers_out.headers, headers);
@@ -546,11 +703,17 @@ void copy_response_headers_from_ngx(const ngx_http_request_t* r,
   // request_->headers_out.headers.
   headers->Add(HttpAttributes::kContentType,
                str_to_string_piece(r->headers_out.content_type));
+}
+
+}  // namespace
+
+void copy_response_headers_from_ngx(const ngx_http_request_t* r,
+                                    ResponseHeaders* headers) {
+  copy_response_header_fields_from_ngx(r, headers);
 
   // When we don't have a date header, set one with the current time.
   if (headers->Lookup1(HttpAttributes::kDate) == NULL) {
-    PosixTimer timer;
-    headers->SetDate(timer.NowMs());
+    headers->SetDate(ps_cached_now_ms());
   }
 
   // TODO(oschaaf): ComputeCaching should be called in setupforhtml()?
@@ -582,22 +745,27 @@ ngx_int_t copy_response_headers_to_ngx(
     // copy these strings later on.
     const GoogleString& name_gs = pagespeed_headers.Name(i);
     const GoogleString& value_gs = pagespeed_headers.Value(i);
+    const ResponseHeaderInfo* info = response_header_classifier.Lookup(name_gs);
 
-    if (preserve_caching_headers == kPreserveAllCachingHeaders) {
-      if (StringCaseEqual(name_gs, "ETag") ||
-          StringCaseEqual(name_gs, "Expires") ||
-          StringCaseEqual(name_gs, "Date") ||
-          StringCaseEqual(name_gs, "Last-Modified") ||
-          StringCaseEqual(name_gs, "Cache-Control")) {
-        continue;
-      }
-    } else if (preserve_caching_headers == kPreserveOnlyCacheControl) {
-      // Retain the original Cache-Control header, but send the recomputed
-      // values for all other cache-related headers.
-      if (StringCaseEqual(name_gs, "Cache-Control")) {
+    if (info != NULL) {
+      if (preserve_caching_headers == kPreserveAllCachingHeaders) {
+        if (info->caching) {
+          continue;
+        }
+      } else if (preserve_caching_headers == kPreserveOnlyCacheControl) {
+        // Retain the original Cache-Control header, but send the recomputed
+        // values for all other cache-related headers.
+        if (info->kind == kCacheControlHeader) {
+          continue;
+        }
+      }  // else we don't preserve any headers.
+
+      // TODO(oschaaf): are there any other headers we should not try to
+      // copy here?
+      if (info->kind == kHopByHopHeader) {
         continue;
       }
-    }  // else we don't preserve any headers.
+    }
 
     ngx_str_t name, value;
     value.len = value_gs.size();
@@ -607,11 +775,14 @@ ngx_int_t copy_response_headers_to_ngx(
     // To prevent the gzip module from clearing weak etags, we output them
     // using a different name here. The etag header filter module runs behind
     // the gzip compressors header filter, and will rename it to 'ETag'
-    if (StringCaseEqual(name_gs, "etag")
+    if (info != NULL && info->kind == kEtagHeader
         && StringCaseStartsWith(value_gs, "W/")) {
       name.len = strlen(kInternalEtagName);
       name.data = reinterpret_cast<u_char*>(
           const_cast<char*>(kInternalEtagName));
+    } else if (info != NULL && str_to_string_piece(info->name) == name_gs) {
+      // Well-known names live as long as we do, so there's no need to copy.
+      name = info->name;
     } else {
       name.len = name_gs.size();
       name.data = reinterpret_cast<u_char*>(
@@ -631,39 +802,32 @@ ngx_int_t copy_response_headers_to_ngx(
     // shouldn't apply to our generated resources.  See Apache code in
     // net/instaweb/apache/header_util:AddResponseHeadersToRequest
 
-    // Make copies of name and value to put into headers_out.
-    if (STR_EQ_LITERAL(name, "Cache-Control")) {
-      ps_set_cache_control(r, reinterpret_cast<char*>(value.data));
-      continue;
-    } else if (STR_EQ_LITERAL(name, "Content-Type")) {
-      // Unlike all the other headers, content_type is just a string.
-      headers_out->content_type = value;
-
-      // We should not include the charset when determining content_type_len, so
-      // scan for the ';' that marks the start of the charset part.
-      for (ngx_uint_t i = 0; i < value.len; i++) {
-        if (value.data[i] == ';') {
-          break;
+    if (info != NULL) {
+      if (info->kind == kCacheControlHeader) {
+        ps_set_cache_control(r, reinterpret_cast<char*>(value.data));
+        continue;
+      } else if (info->kind == kContentTypeHeader) {
+        // Unlike all the other headers, content_type is just a string.
+        headers_out->content_type = value;
+
+        // We should not include the charset when determining content_type_len,
+        // so scan for the ';' that marks the start of the charset part.
+        for (ngx_uint_t i = 0; i < value.len; i++) {
+          if (value.data[i] == ';') {
+            break;
+          }
+          headers_out->content_type_len = i + 1;
         }
-        headers_out->content_type_len = i + 1;
-      }
 
-      // In ngx_http_test_content_type() nginx will allocate and calculate
-      // content_type_lowcase if we leave it as null.
-      headers_out->content_type_lowcase = NULL;
-      continue;
-      // TODO(oschaaf): are there any other headers we should not try to
-      // copy here?
-    } else if (STR_EQ_LITERAL(name, "Connection")) {
-      continue;
-    } else if (STR_EQ_LITERAL(name, "Keep-Alive")) {
-      continue;
-    } else if (STR_EQ_LITERAL(name, "Transfer-Encoding")) {
-      continue;
-    } else if (STR_EQ_LITERAL(name, "Vary") && value.len
-        && STR_EQ_LITERAL(value, "Accept-Encoding")) {
-      ps_request_ctx_t* ctx = ps_get_request_context(r);
-      ctx->psol_vary_accept_only = true;
+        // In ngx_http_test_content_type() nginx will allocate and calculate
+        // content_type_lowcase if we leave it as null.
+        headers_out->content_type_lowcase = NULL;
+        continue;
+      } else if (info->kind == kVaryHeader && value.len
+          && STR_EQ_LITERAL(value, "Accept-Encoding")) {
+        ps_request_ctx_t* ctx = ps_get_request_context(r);
+        ctx->psol_vary_accept_only = true;
+      }
     }
 
     ngx_table_elt_t* header = static_cast<ngx_table_elt_t*>(
@@ -678,37 +842,58 @@ ngx_int_t copy_response_headers_to_ngx(
     header->value.data = value.data;
     header->value.len = value.len;
 
+    if (info == NULL) {
+      continue;
+    }
+
     // Populate the shortcuts to commonly used headers.
-    if (STR_EQ_LITERAL(name, "Date")) {
-      headers_out->date = header;
-    } else if (STR_EQ_LITERAL(name, "Etag")) {
-      headers_out->etag = header;
-    } else if (STR_EQ_LITERAL(name, "Expires")) {
-      headers_out->expires = header;
-    } else if (STR_EQ_LITERAL(name, "Last-Modified")) {
-      headers_out->last_modified = header;
-    } else if (STR_EQ_LITERAL(name, "Location")) {
-      ps_request_ctx_t* ctx = ps_get_request_context(r);
-      if (ctx->location_field_set) {
-        headers_out->location = header;
+    switch (info->kind) {
+      case kDateHeader:
+        headers_out->date = header;
+        break;
+      case kEtagHeader:
+        headers_out->etag = header;
+        break;
+      case kExpiresHeader:
+        headers_out->expires = header;
+        break;
+      case kLastModifiedHeader:
+        headers_out->last_modified = header;
+        break;
+      case kLocationHeader: {
+        ps_request_ctx_t* ctx = ps_get_request_context(r);
+        if (ctx->location_field_set) {
+          headers_out->location = header;
+        }
+        break;
       }
-    } else if (STR_EQ_LITERAL(name, "Server")) {
-      headers_out->server = header;
-    } else if (STR_EQ_LITERAL(name, "Content-Length")) {
-      int64 len;
-      CHECK(pagespeed_headers.FindContentLength(&len));
-      headers_out->content_length_n = len;
-      headers_out->content_length = header;
-    } else if (STR_EQ_LITERAL(name, "Content-Encoding")) {
-      headers_out->content_encoding = header;
-    } else if (STR_EQ_LITERAL(name, "Refresh")) {
-      headers_out->refresh = header;
-    } else if (STR_EQ_LITERAL(name, "Content-Range")) {
-      headers_out->content_range = header;
-    } else if (STR_EQ_LITERAL(name, "Accept-Ranges")) {
-      headers_out->accept_ranges = header;
-    } else if (STR_EQ_LITERAL(name, "WWW-Authenticate")) {
-      headers_out->www_authenticate = header;
+      case kServerHeader:
+        headers_out->server = header;
+        break;
+      case kContentLengthHeader: {
+        int64 len;
+        CHECK(pagespeed_headers.FindContentLength(&len));
+        headers_out->content_length_n = len;
+        headers_out->content_length = header;
+        break;
+      }
+      case kContentEncodingHeader:
+        headers_out->content_encoding = header;
+        break;
+      case kRefreshHeader:
+        headers_out->refresh = header;
+        break;
+      case kContentRangeHeader:
+        headers_out->content_range = header;
+        break;
+      case kAcceptRangesHeader:
+        headers_out->accept_ranges = header;
+        break;
+      case kWwwAuthenticateHeader:
+        headers_out->www_authenticate = header;
+        break;
+      default:
+        break;
     }
   }
 
@@ -720,6 +905,17 @@ namespace {
 typedef struct {
   NgxRewriteDriverFactory* driver_factory;
   MessageHandler* handler;
+  // Cache keys being recorded for IPRO by some worker, so the others leave
+  // them alone.
+  NgxSharedHashTable* ipro_recordings;
+  // Cache keys an IPRO lookup recently found can't be rewritten, so we can
+  // pass on them without another lookup.
+  NgxSharedHashTable* ipro_negative_lookups;
+  // Page URLs and beacon kinds a beacon was recently accepted for, see
+  // BeaconRateLimitMs.
+  NgxSharedHashTable* beacon_rate_limits;
+  // Index of $pagespeed_timing, which ps_release_request_context sets.
+  ngx_int_t timing_variable_index;
 } ps_main_conf_t;
 
 typedef struct {
@@ -735,6 +931,10 @@ typedef struct {
   // likely want cfg_s->server_context->config() as options here will be NULL.
   NgxRewriteOptions* options;
   MessageHandler* handler;
+  // Whether the Allow/Disallow decision made with the server's options is
+  // final, because nothing evaluated per request can change which options
+  // apply.  See ps_can_decline_early().
+  bool allow_list_is_final;
 } ps_srv_conf_t;
 
 typedef struct {
@@ -742,26 +942,6 @@ typedef struct {
   MessageHandler* handler;
 } ps_loc_conf_t;
 
-namespace RequestRouting {
-enum Response {
-  kError,
-  kStaticContent,
-  kInvalidUrl,
-  kPagespeedDisabled,
-  kBeacon,
-  kStatistics,
-  kGlobalStatistics,
-  kConsole,
-  kMessages,
-  kAdmin,
-  kCachePurge,
-  kGlobalAdmin,
-  kPagespeedSubrequest,
-  kErrorResponse,
-  kResource,
-};
-}  // namespace RequestRouting
-
 char* ps_main_configure(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 char* ps_srv_configure(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 char* ps_loc_configure(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
@@ -880,6 +1060,15 @@ ngx_int_t ps_dollar(
   return NGX_OK;
 }
 
+// $pagespeed_timing only gets a value when ps_release_request_context stores
+// the request's phase timings in it, which nginx does just before writing the
+// access log.  Until then, and for requests that weren't timed, it's unset.
+ngx_int_t ps_timing_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+  v->not_found = 1;
+  return NGX_OK;
+}
+
 // Parse the configuration option represented by cf and add it to options,
 // creating options if necessary.
 char* ps_configure(ngx_conf_t* cf,
@@ -1155,6 +1344,54 @@ namespace {
 
 int times_ps_merge_srv_conf_called = 0;
 
+// Paths a server block may handle itself, in the order ps_classify_request
+// considers them.  These are route ids for the server context's path router.
+enum PagespeedPath {
+  kStaticAssetPath,
+  kStatisticsPath,
+  kGlobalStatisticsPath,
+  kConsolePath,
+  kMessagesPath,
+  kAdminPath,
+  kGlobalAdminPath,
+  kHttpBeaconPath,
+  kHttpsBeaconPath,
+};
+
+inline uint32 ps_path_bit(PagespeedPath path) {
+  return 1u << path;
+}
+
+// Compiles the paths a server block serves itself into its path router, so
+// routing a request takes one trie walk.
+void ps_build_path_router(NgxServerContext* server_context) {
+  const NgxRewriteOptions* options = server_context->config();
+  NgxRewriteDriverFactory* factory =
+      server_context->ngx_rewrite_driver_factory();
+  NgxPathRouter* router = server_context->path_router();
+
+  router->Add(factory->static_asset_prefix(), NgxPathRouter::kDirectory,
+              true /* case_sensitive */, kStaticAssetPath);
+  router->Add(options->statistics_path(), NgxPathRouter::kExact,
+              false /* case_sensitive */, kStatisticsPath);
+  router->Add(options->global_statistics_path(), NgxPathRouter::kExact,
+              false /* case_sensitive */, kGlobalStatisticsPath);
+  router->Add(options->console_path(), NgxPathRouter::kExact,
+              false /* case_sensitive */, kConsolePath);
+  router->Add(options->messages_path(), NgxPathRouter::kExact,
+              false /* case_sensitive */, kMessagesPath);
+  // The admin handlers get everything under a path (/path/*) while all the
+  // other handlers only get exact matches (/path).
+  router->Add(options->admin_path(), NgxPathRouter::kPrefix,
+              false /* case_sensitive */, kAdminPath);
+  router->Add(options->global_admin_path(), NgxPathRouter::kPrefix,
+              false /* case_sensitive */, kGlobalAdminPath);
+  router->Add(options->beacon_url().http, NgxPathRouter::kExact,
+              true /* case_sensitive */, kHttpBeaconPath);
+  router->Add(options->beacon_url().https, NgxPathRouter::kExact,
+              true /* case_sensitive */, kHttpsBeaconPath);
+}
+
 }  // namespace
 
 // Called exactly once per server block to merge the main configuration with the
@@ -1205,6 +1442,15 @@ char* ps_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child) {
   delete cfg_s->options;
   cfg_s->options = NULL;
 
+  ps_build_path_router(cfg_s->server_context);
+
+  NgxRewriteOptions* server_options = cfg_s->server_context->config();
+  cfg_s->allow_list_is_final =
+      server_options->script_lines().size() == 0 &&
+      server_options->remote_configuration_url().empty() &&
+      !server_options->running_experiment() &&
+      !server_options->respect_x_forwarded_proto();
+
   if (!cfg_s->server_context->global_options()->unplugged()) {
     // Validate FileCachePath
     GoogleMessageHandler handler;
@@ -1381,8 +1627,10 @@ ngx_int_t ps_decline_request(ngx_http_request_t* r) {
   ps_request_ctx_t* ctx = ps_get_request_context(r);
   CHECK(ctx != NULL);
 
-  ctx->driver->Cleanup();
-  ctx->driver = NULL;
+  if (ctx->driver != NULL) {
+    ctx->driver->Cleanup();
+    ctx->driver = NULL;
+  }
   ctx->location_field_set = false;
   ctx->psol_vary_accept_only = false;
 
@@ -1432,21 +1680,18 @@ ps_loc_conf_t* ps_get_loc_config(ngx_http_request_t* r) {
       ngx_http_get_module_loc_conf(r, ngx_pagespeed));
 }
 
-RewriteOptions* ps_determine_remote_options(ps_srv_conf_t* cfg_s) {
+// Returns the latest snapshot of the global options with the remote
+// configuration merged in, or NULL if there is no remote configuration or it
+// hasn't been fetched yet.  Until then requests use the configured options
+// rather than wait for the remote configuration server.
+NgxSharedOptionsPtr ps_determine_remote_options(ps_srv_conf_t* cfg_s) {
   if (!cfg_s || !cfg_s->server_context ||
-      !cfg_s->server_context->global_options()) {
-    return NULL;
+      !cfg_s->server_context->global_options() ||
+      cfg_s->server_context->global_options()
+          ->remote_configuration_url().empty()) {
+    return NgxSharedOptionsPtr();
   }
-  if (!cfg_s->server_context->global_options()
-          ->remote_configuration_url()
-          .empty()) {
-    RewriteOptions* remote_options =
-        cfg_s->server_context->global_options()->Clone();
-    // This fetch is blocking for up to remote_configuration_timeout_ms ms.
-    cfg_s->server_context->GetRemoteOptions(remote_options, false);
-    return remote_options;
-  }
-  return NULL;
+  return cfg_s->server_context->LatestRemoteOptions();
 }
 
 // Wrapper around GetQueryOptions()
@@ -1498,8 +1743,7 @@ bool ps_set_experiment_state_and_cookie(ngx_http_request_t* r,
           *request_headers, *cfg_s->server_context->user_agent_matcher(),
           options);
   if (need_cookie && host.length() > 0) {
-    PosixTimer timer;
-    int64 time_now_ms = timer.NowMs();
+    int64 time_now_ms = ps_cached_now_ms();
     int64 expiration_time_ms = (time_now_ms +
                                 options->experiment_cookie_duration_ms());
 
@@ -1532,6 +1776,52 @@ bool ps_set_experiment_state_and_cookie(ngx_http_request_t* r,
   return true;
 }
 
+// Looks up, or resolves and caches, the options for a request that has no
+// options of its own: base_options, the location or server options, with
+// their script variables evaluated for r.  Returns false if the script
+// variables can't be evaluated or applied.
+bool ps_resolve_shared_options(ngx_http_request_t* r,
+                               ps_srv_conf_t* cfg_s,
+                               RewriteOptions* base_options,
+                               NgxSharedOptionsPtr* shared_options) {
+  NgxRewriteOptions* ngx_base_options =
+      NgxRewriteOptions::DynamicCast(base_options);
+  NgxRewriteDriverFactory* ngx_factory =
+      dynamic_cast<NgxRewriteDriverFactory*>(cfg_s->server_context->factory());
+
+  StringPieceVector script_values;
+  if (!ngx_base_options->EvaluateScriptVariables(
+          r, cfg_s->handler, &script_values)) {
+    cfg_s->handler->Message(
+        kWarning, "Script error(s) in configuration, disabling optimization");
+    return false;
+  }
+
+  // Requests with the same base options and script values resolve to the
+  // same options.
+  GoogleString key = StringPrintf("%p", static_cast<void*>(base_options));
+  for (int i = 0, n = script_values.size(); i < n; ++i) {
+    StrAppend(&key, " ", IntegerToString(script_values[i].size()), ":",
+              script_values[i]);
+  }
+
+  NgxServerContext* server_context = cfg_s->server_context;
+  *shared_options = server_context->LookupResolvedOptions(key);
+  if (shared_options->get() != NULL) {
+    return true;
+  }
+
+  NgxRewriteOptions* resolved = ngx_base_options->Clone();
+  if (!resolved->ApplyScriptVariables(
+          script_values, r->pool, cfg_s->handler, ngx_factory)) {
+    delete resolved;
+    return false;
+  }
+  shared_options->reset(new NgxSharedOptions(resolved, key));
+  server_context->InsertResolvedOptions(key, *shared_options);
+  return true;
+}
+
 // There are many sources of options:
 //  - the request (query parameters, headers, and cookies)
 //  - location block
@@ -1539,11 +1829,17 @@ bool ps_set_experiment_state_and_cookie(ngx_http_request_t* r,
 //  - experiment framework
 // Consider them all, returning appropriate options for this request, of which
 // the caller takes ownership.  If the only applicable options are global,
-// set options to NULL so we can use server_context->global_options().
+// set options to NULL so we can use server_context->global_options().  If the
+// options don't depend on anything request specific beyond script variables,
+// they may instead come back in shared_options, which the caller must not
+// modify, with options left NULL.  remote_options, if set, is the latest remote
+// configuration snapshot, which stands in for the global options.
 bool ps_determine_options(ngx_http_request_t* r,
                           RequestHeaders* request_headers,
                           ResponseHeaders* response_headers,
+                          const NgxSharedOptionsPtr& remote_options,
                           RewriteOptions** options,
+                          NgxSharedOptionsPtr* shared_options,
                           RequestContextPtr request_context,
                           ps_srv_conf_t* cfg_s,
                           GoogleUrl* url,
@@ -1575,9 +1871,24 @@ bool ps_determine_options(ngx_http_request_t* r,
   if (!have_request_options && directory_options == NULL &&
       !global_options->running_experiment() &&
       ngx_global_options->script_lines().size() == 0) {
+    // The remote configuration snapshot, if any, is already what we want.
+    *shared_options = remote_options;
     return true;
   }
 
+  // Without request, remote, or experiment options the result only depends on
+  // the location and its script variables, so it can be shared.
+  RewriteOptions* base_options =
+      directory_options != NULL ? directory_options : global_options;
+  if (!have_request_options && remote_options.get() == NULL &&
+      !base_options->running_experiment()) {
+    return ps_resolve_shared_options(r, cfg_s, base_options, shared_options);
+  }
+
+  if (remote_options.get() != NULL) {
+    *options = remote_options->options()->Clone();
+  }
+
   // Start with directory options if we have them, otherwise request options.
   if (directory_options != NULL) {
     if (*options != NULL) {
@@ -1722,6 +2033,45 @@ void ps_create_base_fetch(StringPiece url,
   ctx->base_fetch->SetRequestHeadersTakingOwnership(request_headers);
 }
 
+// Finishes ctx's IPRO recording, which deletes the recorder, and lets other
+// workers record this resource again.
+void ps_finish_recording(ps_request_ctx_t* ctx,
+                         ResponseHeaders* response_headers,
+                         bool entire_response_received) {
+  ctx->recorder->DoneAndSetHeaders(response_headers,
+                                   entire_response_received);
+  ctx->recorder = NULL;
+
+  ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+      ngx_http_get_module_main_conf(ctx->r, ngx_pagespeed));
+  cfg_m->ipro_recordings->Release(ctx->recording_key,
+                                  ctx->recording_expires_ms);
+}
+
+// Adds ctx's phase timings to the histograms and stores them in
+// $pagespeed_timing for the access log.
+void ps_finish_timing(ps_request_ctx_t* ctx) {
+  ngx_http_request_t* r = ctx->r;
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  ctx->timing->Record(cfg_s->server_context->statistics());
+
+  ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+      ngx_http_get_module_main_conf(r, ngx_pagespeed));
+  u_char* data = static_cast<u_char*>(
+      ngx_pnalloc(r->pool, NgxRequestTiming::kMaxFormattedSize));
+  if (data != NULL && r->variables != NULL) {
+    ngx_http_variable_value_t* v = &r->variables[cfg_m->timing_variable_index];
+    v->data = data;
+    v->len = ctx->timing->Format(data) - data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+  }
+
+  delete ctx->timing;
+  ctx->timing = NULL;
+}
+
 void ps_release_request_context(void* data) {
   ps_request_ctx_t* ctx = static_cast<ps_request_ctx_t*>(data);
 
@@ -1745,76 +2095,97 @@ void ps_release_request_context(void* data) {
   }
 
   if (ctx->recorder != NULL) {
-    // Deletes recorder.
-    ctx->recorder->DoneAndSetHeaders(NULL, false /* incomplete response */);
-    ctx->recorder = NULL;
+    ps_finish_recording(ctx, NULL, false /* incomplete response */);
+  }
+#if (NGX_THREADS)
+  if (ctx->recording_file_reader != NULL) {
+    // The reader finishes the recording once its reads are back.
+    ctx->recording_file_reader->Finish(NULL, false /* incomplete response */);
+    ctx->recording_file_reader = NULL;
   }
+#endif
 
   ps_release_base_fetch(ctx);
-  delete ctx;
-}
 
-// Set us up for processing a request.  Creates a request context and determines
-// which handler should deal with the request.
-RequestRouting::Response ps_route_request(ngx_http_request_t* r) {
-  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
-
-  if (ps_disabled(cfg_s)) {
-    // Not enabled for this server block.
-    return RequestRouting::kPagespeedDisabled;
-  }
-
-  if (ngx_terminate || ngx_exiting) {
-    return RequestRouting::kError;
-  }
-  if (r->err_status != 0) {
-    return RequestRouting::kErrorResponse;
+  if (ctx->timing != NULL) {
+    ps_finish_timing(ctx);
   }
+  // nginx logs the request after releasing us, and the log may look at our
+  // variables, so don't leave it a dangling context.
+  ngx_http_set_ctx(ctx->r, NULL, ngx_pagespeed);
 
-  GoogleString url_string = ps_determine_url(r);
-  GoogleUrl url(url_string);
+  delete ctx->request_headers;
+  delete ctx->url;
+  delete ctx;
+}
 
-  if (!url.IsWebValid()) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "invalid url");
+// Creates the context for a request we've just routed, taking ownership of its
+// parsed url, and arranges for it to be released with the request.  The
+// context starts out passing the request through untouched; handlers fill in
+// the rest once they decide to take it.  Returns NULL on allocation failure.
+ps_request_ctx_t* ps_create_request_context(ngx_http_request_t* r,
+                                            GoogleUrl* url) {
+  ps_request_ctx_t* ctx = new ps_request_ctx_t();
+  ctx->r = r;
+  ctx->html_rewrite = false;
+  ctx->in_place = false;
+  ctx->preserve_caching_headers = kDontPreserveHeaders;
+  ctx->recorder = NULL;
+  ctx->recording_file_reader = NULL;
+  ctx->recording_expires_ms = 0;
+  ctx->ipro_negative_ttl_ms = 0;
+  ctx->request_headers = NULL;
+  ctx->url = url;
+  ctx->location_field_set = false;
+  ctx->psol_vary_accept_only = false;
+  ctx->timing = NULL;
 
-    // Let nginx deal with the error however it wants; we will see a NULL ctx in
-    // the body filter or content handler and do nothing.
-    return RequestRouting::kInvalidUrl;
+  ngx_http_cleanup_t* cleanup = ngx_http_cleanup_add(r, 0);
+  if (cleanup == NULL) {
+    ps_release_request_context(ctx);
+    return NULL;
   }
+  cleanup->handler = ps_release_request_context;
+  cleanup->data = ctx;
+  ngx_http_set_ctx(r, ctx, ngx_pagespeed);
+  return ctx;
+}
 
+// Determines which handler should deal with a request for url.
+RequestRouting::Response ps_classify_request(ngx_http_request_t* r,
+                                             ps_srv_conf_t* cfg_s,
+                                             const GoogleUrl& url) {
   if (is_pagespeed_subrequest(r)) {
     return RequestRouting::kPagespeedSubrequest;
-  } else if (
-      url.PathSansLeaf() == dynamic_cast<NgxRewriteDriverFactory*>(
-          cfg_s->server_context->factory())->static_asset_prefix()) {
+  }
+
+  // One lookup finds every pagespeed path this request could be for; the
+  // access checks then run in the same order as the paths are listed in
+  // PagespeedPath, so the first allowed handler wins.
+  uint32 paths = cfg_s->server_context->path_router()->Lookup(
+      url.PathSansQuery());
+  if (paths & ps_path_bit(kStaticAssetPath)) {
     return RequestRouting::kStaticContent;
   }
 
   const NgxRewriteOptions* global_options = cfg_s->server_context->config();
 
-  StringPiece path = url.PathSansQuery();
-  if (StringCaseEqual(path, global_options->statistics_path()) &&
+  if ((paths & ps_path_bit(kStatisticsPath)) &&
       global_options->StatisticsAccessAllowed(url)) {
     return RequestRouting::kStatistics;
-  } else if (StringCaseEqual(path, global_options->global_statistics_path()) &&
+  } else if ((paths & ps_path_bit(kGlobalStatisticsPath)) &&
              global_options->GlobalStatisticsAccessAllowed(url)) {
     return RequestRouting::kGlobalStatistics;
-  } else if (StringCaseEqual(path, global_options->console_path()) &&
+  } else if ((paths & ps_path_bit(kConsolePath)) &&
              global_options->ConsoleAccessAllowed(url)) {
     return RequestRouting::kConsole;
-  } else if (StringCaseEqual(path, global_options->messages_path()) &&
+  } else if ((paths & ps_path_bit(kMessagesPath)) &&
              global_options->MessagesAccessAllowed(url)) {
     return RequestRouting::kMessages;
-  } else if (
-      // The admin handlers get everything under a path (/path/*) while all the
-      // other handlers only get exact matches (/path).  So match all paths
-      // starting with the handler path.
-      !global_options->admin_path().empty() &&
-      StringCaseStartsWith(path, global_options->admin_path()) &&
-      global_options->AdminAccessAllowed(url)) {
+  } else if ((paths & ps_path_bit(kAdminPath)) &&
+             global_options->AdminAccessAllowed(url)) {
     return RequestRouting::kAdmin;
-  } else if (!global_options->global_admin_path().empty() &&
-             StringCaseStartsWith(path, global_options->global_admin_path()) &&
+  } else if ((paths & ps_path_bit(kGlobalAdminPath)) &&
              global_options->GlobalAdminAccessAllowed(url)) {
     return RequestRouting::kGlobalAdmin;
   } else if (global_options->enable_cache_purge() &&
@@ -1824,20 +2195,156 @@ RequestRouting::Response ps_route_request(ngx_http_request_t* r) {
     return RequestRouting::kCachePurge;
   }
 
-  const GoogleString* beacon_url;
-  if (ps_is_https(r)) {
-    beacon_url = &(global_options->beacon_url().https);
-  } else {
-    beacon_url = &(global_options->beacon_url().http);
-  }
-
-  if (url.PathSansQuery() == StringPiece(*beacon_url)) {
+  if (paths & ps_path_bit(ps_is_https(r) ? kHttpsBeaconPath
+                                         : kHttpBeaconPath)) {
     return RequestRouting::kBeacon;
   }
 
   return RequestRouting::kResource;
 }
 
+// Set us up for processing a request.  Creates a request context holding the
+// parsed url and determines which handler should deal with the request.
+RequestRouting::Response ps_route_request(ngx_http_request_t* r) {
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+
+  if (ps_disabled(cfg_s)) {
+    // Not enabled for this server block.
+    return RequestRouting::kPagespeedDisabled;
+  }
+
+  if (ngx_terminate || ngx_exiting) {
+    return RequestRouting::kError;
+  }
+  if (r->err_status != 0) {
+    return RequestRouting::kErrorResponse;
+  }
+
+  ps_request_ctx_t* ctx = ps_get_request_context(r);
+  if (ctx != NULL) {
+    // Already routed.
+    return ctx->routing;
+  }
+
+  bool timed = cfg_s->server_context->config()->request_phase_timing();
+  int64 start_us = timed ? NgxRequestTiming::NowUs() : 0;
+
+  scoped_ptr<GoogleUrl> url(new GoogleUrl(ps_determine_url(r)));
+
+  if (!url->IsWebValid()) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "invalid url");
+
+    // Let nginx deal with the error however it wants; we will see a NULL ctx in
+    // the body filter or content handler and do nothing.
+    return RequestRouting::kInvalidUrl;
+  }
+
+  ctx = ps_create_request_context(r, url.release());
+  if (ctx == NULL) {
+    return RequestRouting::kError;
+  }
+  ctx->routing = ps_classify_request(r, cfg_s, *ctx->url);
+  if (timed) {
+    ctx->timing = new NgxRequestTiming();
+    ctx->timing->Add(NgxRequestTiming::kRoute,
+                     NgxRequestTiming::NowUs() - start_us);
+  }
+  return ctx->routing;
+}
+
+// Shared options can't be handed off to something that takes ownership of its
+// options, like a ResourceFetch or a custom RewriteDriver.  If we're using
+// shared options, returns the pool whose drivers use them as they are.  If
+// they don't have a pool, gives custom_options a copy of them and points
+// options at it, so everything working on this request sees the same object.
+RewriteDriverPool* ps_unshare_options(
+    ps_srv_conf_t* cfg_s, const NgxSharedOptionsPtr& shared_options,
+    scoped_ptr<RewriteOptions>* custom_options, RewriteOptions** options) {
+  if (custom_options->get() != NULL || shared_options.get() == NULL) {
+    return NULL;
+  }
+  RewriteDriverPool* driver_pool =
+      cfg_s->server_context->SharedOptionsDriverPool(shared_options);
+  if (driver_pool == NULL) {
+    custom_options->reset(shared_options->options()->Clone());
+    *options = custom_options->get();
+  }
+  return driver_pool;
+}
+
+// Returns a rewrite driver for a request's options, as set up by
+// ps_unshare_options.  The driver takes ownership of custom_options.
+RewriteDriver* ps_new_rewrite_driver(
+    ps_srv_conf_t* cfg_s, RewriteDriverPool* driver_pool,
+    scoped_ptr<RewriteOptions>* custom_options,
+    const RequestContextPtr& request_context) {
+  NgxServerContext* server_context = cfg_s->server_context;
+  if (driver_pool != NULL) {
+    return server_context->NewRewriteDriverFromPool(driver_pool,
+                                                    request_context);
+  }
+  // If we don't have custom options we can use NewRewriteDriver which reuses
+  // rewrite drivers and so is faster because there's no wait to construct
+  // them.  Otherwise we have to build a new one every time.
+  if (custom_options->get() == NULL) {
+    return server_context->NewRewriteDriver(request_context);
+  }
+  return server_context->NewCustomRewriteDriver(custom_options->release(),
+                                                request_context);
+}
+
+// Returns true if configuration alone tells us pagespeed won't do anything
+// with this request, so we can decline it without copying its headers or
+// resolving options.  That's the case when the server's options Disallow the
+// url and nothing per request can change that, unless the url is a .pagespeed.
+// resource (served even under Disallow) or proxied with MapProxyDomain.
+bool ps_can_decline_early(ngx_http_request_t* r, ps_srv_conf_t* cfg_s,
+                          const GoogleUrl& url) {
+  if (!cfg_s->allow_list_is_final || r != r->main) {
+    return false;
+  }
+
+  if (ps_get_loc_config(r)->options != NULL) {
+    // The location block may Allow this url again.
+    return false;
+  }
+
+  // PageSpeed query parameters are stripped before Allow/Disallow is checked,
+  // so leave urls that might have any to the full path.
+  static u_char kPagespeed[] = "pagespeed";
+  if (r->args.len > 0 &&
+      ngx_strlcasestrn(r->args.data, r->args.data + r->args.len, kPagespeed,
+                       sizeof(kPagespeed) - 2) != NULL) {
+    return false;
+  }
+
+  const NgxRewriteOptions* options = cfg_s->server_context->config();
+  return (!options->IsAllowed(url.Spec()) &&
+          !options->domain_lawyer()->IsProxyMapped(url) &&
+          !cfg_s->server_context->IsPagespeedResource(url));
+}
+
+// Key for cache_url in the tables shared between workers that track IPRO
+// lookups and recordings.
+uint64 ps_ipro_key(const RewriteOptions* options, StringPiece cache_url) {
+  return NgxSharedHashTable::HashKey(
+      StrCat(options->cache_fragment(), " ", cache_url));
+}
+
+// How long to remember that an IPRO lookup found url can't be rewritten, or 0
+// if lookups with these options shouldn't be remembered.  Options built for
+// one request, from query parameters or headers, may rewrite what the
+// configured ones can't, so only the latter are remembered.
+int64 ps_ipro_negative_ttl_ms(const RewriteOptions* options,
+                              bool custom_options) {
+  const NgxRewriteOptions* ngx_options =
+      NgxRewriteOptions::DynamicCast(options);
+  if (custom_options || ngx_options == NULL) {
+    return 0;
+  }
+  return ngx_options->in_place_negative_lookup_ttl_ms();
+}
+
 ngx_int_t ps_resource_handler(ngx_http_request_t* r,
                               bool html_rewrite,
                               RequestRouting::Response response_category) {
@@ -1859,7 +2366,8 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     return NGX_DECLINED;
   }
 
-  CHECK(!(html_rewrite && (ctx == NULL || ctx->html_rewrite == false)));
+  CHECK(ctx != NULL);
+  CHECK(!(html_rewrite && ctx->html_rewrite == false));
 
   if (!html_rewrite &&
       r->method != NGX_HTTP_GET &&
@@ -1869,42 +2377,58 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     return NGX_DECLINED;
   }
 
-  GoogleString url_string = ps_determine_url(r);
-  GoogleUrl url(url_string);
+  // ps_route_request already checked that this is valid.  Work on a copy,
+  // since ps_determine_options strips our query parameters from it.
+  GoogleUrl url;
+  url.Reset(*ctx->url);
 
-  if (!url.IsWebValid()) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "invalid url");
-    return NGX_DECLINED;
-  }
-
-  scoped_ptr<RequestHeaders> request_headers(new RequestHeaders);
+  // If the content phase already imported the request headers and passed on
+  // this request, pick them up instead of copying them over again.
+  scoped_ptr<RequestHeaders> request_headers(ctx->request_headers);
+  ctx->request_headers = NULL;
+  // These are only scanned for PageSpeed option headers, which doesn't need a
+  // Date or caching computed.
   scoped_ptr<ResponseHeaders> response_headers(new ResponseHeaders);
-
-  copy_request_headers_from_ngx(r, request_headers.get());
-  copy_response_headers_from_ngx(r, response_headers.get());
+  {
+    NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kHeaderImport);
+    if (request_headers.get() == NULL) {
+      request_headers.reset(new RequestHeaders);
+      copy_request_headers_from_ngx(r, request_headers.get());
+    }
+    copy_response_header_fields_from_ngx(r, response_headers.get());
+  }
 
   RequestContextPtr request_context(
       cfg_s->server_context->NewRequestContext(r));
   GoogleString pagespeed_query_params;
   GoogleString pagespeed_option_cookies;
-  RewriteOptions* options = ps_determine_remote_options(cfg_s);
-  if (!ps_determine_options(r, request_headers.get(), response_headers.get(),
-                            &options, request_context, cfg_s, &url,
-                            &pagespeed_query_params, &pagespeed_option_cookies,
-                            html_rewrite)) {
+  RewriteOptions* options = NULL;
+  NgxSharedOptionsPtr shared_options;
+  bool options_ok;
+  {
+    NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kOptions);
+    options_ok = ps_determine_options(
+        r, request_headers.get(), response_headers.get(),
+        ps_determine_remote_options(cfg_s), &options, &shared_options,
+        request_context, cfg_s, &url, &pagespeed_query_params,
+        &pagespeed_option_cookies, html_rewrite);
+  }
+  if (!options_ok) {
     return NGX_ERROR;
   }
 
   // Take ownership of custom_options.
   scoped_ptr<RewriteOptions> custom_options(options);
   if (options == NULL) {
-    options = cfg_s->server_context->global_options();
+    options = (shared_options.get() != NULL) ?
+        shared_options->options() : cfg_s->server_context->global_options();
   }
 
   request_context->set_options(options->ComputeHttpOptions());
 
   // ps_determine_options modified url, removing any ModPagespeedFoo=Bar query
   // parameters.  Keep url_string in sync with url.
+  GoogleString url_string;
   url.Spec().CopyToString(&url_string);
 
   if (cfg_s->server_context->global_options()->respect_x_forwarded_proto()) {
@@ -1936,13 +2460,8 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   }
 
   if (!html_rewrite) {
-    // create request ctx
-    CHECK(ctx == NULL);
-    ctx = new ps_request_ctx_t();
-
-    ctx->r = r;
-    ctx->html_rewrite = false;
-    ctx->in_place = false;
+    // ps_route_request created ctx with pass-through defaults; fill in what
+    // we need now that we're handling this request.
     ctx->follow_flushes = options->follow_flushes();
     ctx->preserve_caching_headers = kDontPreserveHeaders;
 
@@ -1968,32 +2487,31 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
       }
     }
 
-    ctx->recorder = NULL;
     ctx->url_string = url_string;
-    ctx->location_field_set = false;
-    ctx->psol_vary_accept_only = false;
-
-    // Set up a cleanup handler on the request.
-    ngx_http_cleanup_t* cleanup = ngx_http_cleanup_add(r, 0);
-    if (cleanup == NULL) {
-      ps_release_request_context(ctx);
-      return NGX_ERROR;
-    }
-    cleanup->handler = ps_release_request_context;
-    cleanup->data = ctx;
-    ngx_http_set_ctx(r, ctx, ngx_pagespeed);
   }
 
   if (pagespeed_resource) {
+    RewriteDriverPool* driver_pool =
+        ps_unshare_options(cfg_s, shared_options, &custom_options, &options);
     // TODO(jefftk): Set using_spdy appropriately.  See
     // ProxyInterface::ProxyRequestCallback
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kPageSpeedResource,
                          options);
-    ResourceFetch::Start(
-        url,
-        custom_options.release() /* null if there aren't custom options */,
-        cfg_s->server_context, ctx->base_fetch);
+    if (driver_pool != NULL) {
+      // Shared options never run experiments, so there are no experiment
+      // options for ResourceFetch::Start to apply.
+      ResourceFetch::StartWithDriver(
+          url, ResourceFetch::kAutoCleanupDriver, cfg_s->server_context,
+          ps_new_rewrite_driver(cfg_s, driver_pool, &custom_options,
+                                ctx->base_fetch->request_context()),
+          ctx->base_fetch);
+    } else {
+      ResourceFetch::Start(
+          url,
+          custom_options.release() /* null if there aren't custom options */,
+          cfg_s->server_context, ctx->base_fetch);
+    }
     return ps_async_wait_response(r);
   } else if (is_an_admin_handler) {
     ps_create_base_fetch(url.Spec(), ctx, request_context,
@@ -2001,8 +2519,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     QueryParams query_params;
     query_params.ParseFromUrl(url);
 
-    PosixTimer timer;
-    int64 now_ms = timer.NowMs();
+    int64 now_ms = ps_cached_now_ms();
     ctx->base_fetch->response_headers()->SetDateAndCaching(
         now_ms, 0 /* max-age */, ", no-cache");
 
@@ -2025,8 +2542,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
           response_category == RequestRouting::kGlobalAdmin,
           url,
           query_params,
-          custom_options == NULL ? cfg_s->server_context->config()
-                                 : custom_options.get(),
+          options,
           ctx->base_fetch);
     } else if (response_category == RequestRouting::kCachePurge) {
       AdminSite* admin_site = cfg_s->server_context->admin_site();
@@ -2045,17 +2561,14 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
 
     if (options->domain_lawyer()->MapOriginUrl(
             url, &mapped_url, &host_header, &is_proxy) && is_proxy) {
+      RewriteDriverPool* driver_pool =
+          ps_unshare_options(cfg_s, shared_options, &custom_options, &options);
       ps_create_base_fetch(url.Spec(), ctx, request_context,
                            request_headers.release(), kPageSpeedProxy, options);
 
-      RewriteDriver* driver;
-      if (custom_options.get() == NULL) {
-        driver = cfg_s->server_context->NewRewriteDriver(
-            ctx->base_fetch->request_context());
-      } else {
-        driver = cfg_s->server_context->NewCustomRewriteDriver(
-            custom_options.release(), ctx->base_fetch->request_context());
-      }
+      RewriteDriver* driver = ps_new_rewrite_driver(
+          cfg_s, driver_pool, &custom_options,
+          ctx->base_fetch->request_context());
 
       driver->SetRequestHeaders(*ctx->base_fetch->request_headers());
       driver->set_pagespeed_query_params(pagespeed_query_params);
@@ -2070,23 +2583,14 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   }
 
   if (html_rewrite && options->IsAllowed(url.Spec())) {
+    RewriteDriverPool* driver_pool =
+        ps_unshare_options(cfg_s, shared_options, &custom_options, &options);
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kHtmlTransform, options);
     // Do not store driver in request_context, it's not safe.
-    RewriteDriver* driver;
-
-    // If we don't have custom options we can use NewRewriteDriver which reuses
-    // rewrite drivers and so is faster because there's no wait to construct
-    // them.  Otherwise we have to build a new one every time.
-
-    if (custom_options.get() == NULL) {
-      driver = cfg_s->server_context->NewRewriteDriver(
-          ctx->base_fetch->request_context());
-    } else {
-      // NewCustomRewriteDriver takes ownership of custom_options.
-      driver = cfg_s->server_context->NewCustomRewriteDriver(
-          custom_options.release(), ctx->base_fetch->request_context());
-    }
+    RewriteDriver* driver = ps_new_rewrite_driver(
+        cfg_s, driver_pool, &custom_options,
+        ctx->base_fetch->request_context());
 
     driver->SetRequestHeaders(*ctx->base_fetch->request_headers());
     driver->set_pagespeed_query_params(pagespeed_query_params);
@@ -2111,22 +2615,31 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     return NGX_OK;
   }
 
+  int64 ipro_negative_ttl_ms =
+      ps_ipro_negative_ttl_ms(options, custom_options.get() != NULL);
+  bool ipro_known_unrewritable = false;
+  if (ipro_negative_ttl_ms > 0 && options->in_place_rewriting_enabled()) {
+    // Checked here, before we set up a driver and a base fetch, since the
+    // lookup would only tell us again that we can't do anything.
+    ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+        ngx_http_get_module_main_conf(r, ngx_pagespeed));
+    ipro_known_unrewritable = cfg_m->ipro_negative_lookups->Contains(
+        ps_ipro_key(options, url_string), ps_cached_now_ms());
+  }
+
   if (options->in_place_rewriting_enabled() &&
       options->enabled() &&
-      options->IsAllowed(url.Spec())) {
+      options->IsAllowed(url.Spec()) &&
+      !ipro_known_unrewritable) {
+    RewriteDriverPool* driver_pool =
+        ps_unshare_options(cfg_s, shared_options, &custom_options, &options);
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kIproLookup, options);
 
     // Do not store driver in request_context, it's not safe.
-    RewriteDriver* driver;
-    if (custom_options.get() == NULL) {
-      driver = cfg_s->server_context->NewRewriteDriver(
-          ctx->base_fetch->request_context());
-    } else {
-      // NewCustomRewriteDriver takes ownership of custom_options.
-      driver = cfg_s->server_context->NewCustomRewriteDriver(
-          custom_options.release(), ctx->base_fetch->request_context());
-    }
+    RewriteDriver* driver = ps_new_rewrite_driver(
+        cfg_s, driver_pool, &custom_options,
+        ctx->base_fetch->request_context());
 
     driver->SetRequestHeaders(*ctx->base_fetch->request_headers());
     ctx->driver = driver;
@@ -2136,8 +2649,17 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
         url_string.c_str());
 
     ctx->in_place = true;
+    ctx->ipro_request_context = ctx->base_fetch->request_context();
+    ctx->ipro_max_response_bytes = options->ipro_max_response_bytes();
+    ctx->ipro_max_concurrent_recordings =
+        options->ipro_max_concurrent_recordings();
+    ctx->recording_key = ps_ipro_key(options, url_string);
+    ctx->ipro_negative_ttl_ms = ipro_negative_ttl_ms;
     ctx->driver->FetchInPlaceResource(
         url, false /* proxy_mode */, ctx->base_fetch);
+    // Only read once the fetch has given the driver its base URL.  The driver
+    // stays ours until we clean it up, however the fetch goes.
+    ctx->ipro_cache_fragment = ctx->driver->CacheFragment();
 
     return ps_async_wait_response(r);
   }
@@ -2151,17 +2673,40 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   CHECK(ctx->base_fetch == NULL);
   // set html_rewrite flag.
   ctx->html_rewrite = true;
+  // Without custom options ps_determine_options found nothing to strip, so
+  // these are still exactly what nginx has and the html flow can reuse them.
+  if (custom_options.get() == NULL) {
+    ctx->request_headers = request_headers.release();
+  }
   return NGX_DECLINED;
 }
 
+// Gzipped html is inflated into this window and handed to the proxy fetch a
+// window at a time rather than in stack-buffer sized pieces, since every
+// ProxyFetch::Write takes a lock and queues a copy.  Workers are single
+// threaded and Write copies what we give it, so one window serves them all.
+const size_t kInflateWindowSize = 64 * 1024;
+char ps_inflate_window[kInflateWindowSize];
+
+void ps_write_inflated(ps_request_ctx_t* ctx, ps_srv_conf_t* cfg_s,
+                       size_t* window_used) {
+  if (*window_used > 0) {
+    ctx->proxy_fetch->Write(StringPiece(ps_inflate_window, *window_used),
+                            cfg_s->handler);
+    *window_used = 0;
+  }
+}
+
 // Send each buffer in the chain to the proxy_fetch for optimization.
 // Eventually it will make it's way, optimized, to base_fetch.
 void ps_send_to_pagespeed(ngx_http_request_t* r,
                           ps_request_ctx_t* ctx,
                           ps_srv_conf_t* cfg_s,
                           ngx_chain_t* in) {
+  NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kPsolWrite);
   ngx_chain_t* cur;
   int last_buf = 0;
+  size_t window_used = 0;
   for (cur = in; cur != NULL; cur = cur->next) {
     last_buf = cur->buf->last_buf;
     // Buffers are not really the last buffer until they've been through
@@ -2174,18 +2719,20 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
           StringPiece(reinterpret_cast<char*>(cur->buf->pos),
                       cur->buf->last - cur->buf->pos), cfg_s->handler);
     } else {
-      char buf[kStackBufferSize];
       ctx->inflater_->SetInput(reinterpret_cast<char*>(cur->buf->pos),
                                cur->buf->last - cur->buf->pos);
       while (ctx->inflater_->HasUnconsumedInput()) {
+        if (window_used == kInflateWindowSize) {
+          ps_write_inflated(ctx, cfg_s, &window_used);
+        }
         int num_inflated_bytes = ctx->inflater_->InflateBytes(
-            buf, kStackBufferSize);
+            ps_inflate_window + window_used,
+            kInflateWindowSize - window_used);
         if (num_inflated_bytes < 0) {
           cfg_s->handler->Message(kWarning, "Corrupted inflation");
-        } else if (num_inflated_bytes > 0) {
-          ctx->proxy_fetch->Write(StringPiece(buf, num_inflated_bytes),
-                                  cfg_s->handler);
+          break;
         }
+        window_used += num_inflated_bytes;
       }
     }
     if (cur->buf->flush && ctx->follow_flushes) {
@@ -2198,6 +2745,7 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
       // Note that too many flushes could harm optimization over larger html
       // fragments as PSOL gets less context to work with, e.g. it can't combine
       // two css files if a flush happens in between.
+      ps_write_inflated(ctx, cfg_s, &window_used);
       ctx->proxy_fetch->Flush(cfg_s->handler);
     }
 
@@ -2206,6 +2754,8 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
     cur->buf->pos = cur->buf->last;
   }
 
+  ps_write_inflated(ctx, cfg_s, &window_used);
+
   if (last_buf) {
     ctx->proxy_fetch->Done(true /* success */);
     ctx->proxy_fetch = NULL;  // ProxyFetch deletes itself on Done().
@@ -2349,9 +2899,6 @@ ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
     // Don't handle subrequests.
     return ngx_http_next_header_filter(r);
   }
-  // Poll for cache flush on every request (polls are rate-limited).
-  cfg_s->server_context->FlushCacheIfNecessary();
-
   ps_request_ctx_t* ctx = ps_get_request_context(r);
 
   if (ctx == NULL || ctx->html_rewrite == false) {
@@ -2377,46 +2924,57 @@ ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
     return ngx_http_next_header_filter(r);
   }
 
-  ngx_int_t rc = ps_resource_handler(r, true /* html rewrite */,
-                                     RequestRouting::kResource);
-  if (rc != NGX_OK) {
-    ctx->html_rewrite = false;
-    return ngx_http_next_header_filter(r);
-  }
-
+  // We can undo gzip and deflate before parsing, but anything else (br, or
+  // several stacked encodings) would reach the parser as binary.  Find that
+  // out before we set up a rewrite and let those responses through untouched.
+  bool inflate = false;
+  GzipInflater::InflateType inflate_type = GzipInflater::kGzip;
   if (r->headers_out.content_encoding &&
       r->headers_out.content_encoding->value.len) {
     // headers_out.content_encoding will be set to the exact last
     // Content-Encoding response header value that nginx receives. To
     // check if there were multiple (aka stacked) encodings in the
     // response headers, we must iterate them all.
-    if (!ps_has_stacked_content_encoding(r)) {
-      StringPiece content_encoding =
-          str_to_string_piece(r->headers_out.content_encoding->value);
-      GzipInflater::InflateType inflate_type = GzipInflater::kGzip;
-      bool is_encoded = false;
-      if (StringCaseEqual(content_encoding, "deflate")) {
-        is_encoded = true;
-        inflate_type = GzipInflater::kDeflate;
-      } else if (StringCaseEqual(content_encoding, "gzip")) {
-        is_encoded = true;
-      }
-
-      if (is_encoded) {
-        r->headers_out.content_encoding->hash = 0;
-        r->headers_out.content_encoding = NULL;
-        ctx->inflater_ = new GzipInflater(inflate_type);
-        ctx->inflater_->Init();
-      }
+    if (ps_has_stacked_content_encoding(r)) {
+      ctx->html_rewrite = false;
+      return ngx_http_next_header_filter(r);
+    }
+    StringPiece content_encoding =
+        str_to_string_piece(r->headers_out.content_encoding->value);
+    if (StringCaseEqual(content_encoding, "deflate")) {
+      inflate = true;
+      inflate_type = GzipInflater::kDeflate;
+    } else if (StringCaseEqual(content_encoding, "gzip")) {
+      inflate = true;
+    } else if (!StringCaseEqual(content_encoding, "identity")) {
+      ctx->html_rewrite = false;
+      return ngx_http_next_header_filter(r);
     }
   }
 
+  ngx_int_t rc = ps_resource_handler(r, true /* html rewrite */,
+                                     RequestRouting::kResource);
+  if (rc != NGX_OK) {
+    ctx->html_rewrite = false;
+    return ngx_http_next_header_filter(r);
+  }
+
+  if (inflate) {
+    r->headers_out.content_encoding->hash = 0;
+    r->headers_out.content_encoding = NULL;
+    ctx->inflater_ = new GzipInflater(inflate_type);
+    ctx->inflater_->Init();
+  }
+
   ps_strip_html_headers(r);
   // See https://github.com/apache/incubator-pagespeed-ngx/issues/819
   ctx->location_field_set = r->headers_out.location != NULL;
 
   // TODO(jefftk): is this thread safe?
-  copy_response_headers_from_ngx(r, ctx->base_fetch->response_headers());
+  {
+    NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kHeaderImport);
+    copy_response_headers_from_ngx(r, ctx->base_fetch->response_headers());
+  }
 
   ps_set_buffered(r, true);
   r->filter_need_in_memory = 1;
@@ -2476,6 +3034,34 @@ namespace in_place {
 ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 ngx_http_output_body_filter_pt ngx_http_next_body_filter;
 
+// Returns the thread pool to read a recorded response's file buffers on, or
+// NULL if they have to be read into memory before they reach us.  We only
+// use the pool of a location with "aio threads" that names it directly.
+#if (NGX_THREADS)
+ngx_thread_pool_t* ps_recording_thread_pool(ngx_http_request_t* r) {
+  ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
+      ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+  if (clcf->aio != NGX_HTTP_AIO_THREADS) {
+    return NULL;
+  }
+  return clcf->thread_pool;
+}
+
+bool ps_chain_has_file_data(ngx_chain_t* in) {
+  for (ngx_chain_t* cl = in; cl; cl = cl->next) {
+    if (!ngx_buf_in_memory(cl->buf) && cl->buf->in_file &&
+        cl->buf->file_last > cl->buf->file_pos) {
+      return true;
+    }
+  }
+  return false;
+}
+#else
+void* ps_recording_thread_pool(ngx_http_request_t* r) {
+  return NULL;
+}
+#endif
+
 // Header filter to support IPRO.
 //
 // The control flow here is tricky, probably excessively so.
@@ -2504,9 +3090,24 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
     //
     // The recorder will do this checking, so pass it the headers.
     ResponseHeaders response_headers;
-    copy_response_headers_from_ngx(r, &response_headers);
+    {
+      NgxScopedPhaseTimer timer(ctx->timing, NgxRequestTiming::kHeaderImport);
+      copy_response_headers_from_ngx(r, &response_headers);
+    }
     ctx->recorder->ConsiderResponseHeaders(
         InPlaceResourceRecorder::kPreliminaryHeaders, &response_headers);
+    if (ctx->recorder->failed()) {
+      // The headers already rule out caching this response (it's too big,
+      // not cacheable, ...).  Give up on recording now rather than looking
+      // at a body that would just be thrown away.
+      ps_finish_recording(ctx, &response_headers,
+                          false /* incomplete response */);
+    } else if (ps_recording_thread_pool(r) == NULL) {
+      // ps_in_place_body_filter needs the body in memory to record it.  The
+      // copy filter reads file-backed responses for us.  With aio threads
+      // we read them ourselves instead, and they keep sendfile.
+      r->filter_need_in_memory = 1;
+    }
     return ngx_http_next_header_filter(r);
   }
 
@@ -2514,6 +3115,12 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
     return ngx_http_next_header_filter(r);
   }
 
+  // The lookup is over, and what a miss needs from the driver was captured
+  // when it started, so it can go back to the pool now rather than after the
+  // origin's response.
+  ctx->driver->Cleanup();
+  ctx->driver = NULL;
+
   // If our request was finalized during the IPRO lookup, we decline.
   if (r->connection->error) {
     return ps_decline_request(r);
@@ -2528,7 +3135,7 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
   NgxServerContext* server_context = cfg_s->server_context;
   MessageHandler* message_handler = cfg_s->handler;
-  GoogleString url = ps_determine_url(r);
+  GoogleString url = ctx->url->Spec().as_string();
   // The URL we use for cache key is a bit different since it may
   // have PageSpeed query params removed.
   GoogleString cache_url = ctx->url_string;
@@ -2553,37 +3160,58 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
         "Could not rewrite resource in-place "
         "because URL is not in cache: %s",
         cache_url.c_str());
-    const SystemRewriteOptions* options = SystemRewriteOptions::DynamicCast(
-        ctx->driver->options());
-
-    RequestContextPtr request_context(
-        cfg_s->server_context->NewRequestContext(r));
-    request_context->set_options(options->ComputeHttpOptions());
-    RequestHeaders request_headers;
-    copy_request_headers_from_ngx(r, &request_headers);
+
+    // When a hot resource misses, every worker would otherwise record its own
+    // copy of the same response.  Only the first one to claim it records.
+    ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+        ngx_http_get_module_main_conf(r, ngx_pagespeed));
+    int64 now_ms = ps_cached_now_ms();
+    ctx->recording_expires_ms = now_ms + kIproRecordingClaimMs;
+    if (!cfg_m->ipro_recordings->Claim(ctx->recording_key, now_ms,
+                                       ctx->recording_expires_ms)) {
+      message_handler->Message(
+          kInfo, "Not recording %s: another worker is already recording it",
+          cache_url.c_str());
+      return ps_decline_request(r);
+    }
+
+    // The lookup's base fetch still holds the request headers we imported for
+    // it, so record with those rather than copying them out of nginx again.
+    // Its request context already carries the options' http settings.
+    const RequestHeaders* request_headers =
+        ctx->base_fetch->request_headers();
     // This URL was not found in cache (neither the input resource nor
     // a ResourceNotCacheable entry) so we need to get it into cache
     // (or at least a note that it cannot be cached stored there).
     // We do that using an Apache output filter.
     ctx->recorder = new InPlaceResourceRecorder(
-        request_context,
+        ctx->ipro_request_context,
         cache_url,
-        ctx->driver->CacheFragment(),
-        request_headers.GetProperties(),
-        options->ipro_max_response_bytes(),
-        options->ipro_max_concurrent_recordings(),
+        ctx->ipro_cache_fragment,
+        request_headers->GetProperties(),
+        ctx->ipro_max_response_bytes,
+        ctx->ipro_max_concurrent_recordings,
         server_context->http_cache(),
         server_context->statistics(),
         message_handler);
-    // set in memory flag for in_place_body_filter
-    r->filter_need_in_memory = 1;
 
     // We don't have the response headers at all yet because we haven't yet gone
-    // to the backend.
+    // to the backend.  ps_in_place_check_header_filter decides whether the
+    // body needs to be in memory once it has seen them.
   } else {
     server_context->rewrite_stats()->ipro_not_rewritable()->Add(1);
     message_handler->Message(
         kInfo, "Could not rewrite resource in-place: %s", url.c_str());
+
+    // A HEAD request that missed doesn't tell us anything about the resource.
+    if (ctx->ipro_negative_ttl_ms > 0 &&
+        status_code != CacheUrlAsyncFetcher::kNotInCacheStatus) {
+      ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+          ngx_http_get_module_main_conf(r, ngx_pagespeed));
+      int64 now_ms = ps_cached_now_ms();
+      cfg_m->ipro_negative_lookups->Claim(
+          ctx->recording_key, now_ms, now_ms + ctx->ipro_negative_ttl_ms);
+    }
   }
 
   return ps_decline_request(r);
@@ -2593,33 +3221,76 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
 // with IPRO, then log the bytes as they come through
 ngx_int_t ps_in_place_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
   ps_request_ctx_t* ctx = ps_get_request_context(r);
-  if (ctx == NULL || ctx->recorder == NULL) {
+  if (ctx == NULL ||
+      (ctx->recorder == NULL && ctx->recording_file_reader == NULL)) {
     return ngx_http_next_body_filter(r, in);
   }
 
   ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "ps in place body filter: %V", &r->uri);
 
+#if (NGX_THREADS)
+  if (ctx->recording_file_reader == NULL && ps_chain_has_file_data(in)) {
+    ngx_thread_pool_t* thread_pool = ps_recording_thread_pool(r);
+    if (thread_pool != NULL) {
+      ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+          ngx_http_get_module_main_conf(r, ngx_pagespeed));
+      ctx->recording_file_reader = new NgxRecordingFileReader(
+          ctx->recorder, thread_pool, ctx->ipro_max_response_bytes,
+          MakeFunction(cfg_m->ipro_recordings, &NgxSharedHashTable::Release,
+                       ctx->recording_key, ctx->recording_expires_ms));
+      ctx->recorder = NULL;
+    }
+  }
+
+  if (ctx->recording_file_reader != NULL) {
+    for (ngx_chain_t* cl = in; cl; cl = cl->next) {
+      ctx->recording_file_reader->Add(cl->buf);
+      if (cl->buf->last_buf) {
+        ResponseHeaders response_headers;
+        {
+          NgxScopedPhaseTimer timer(ctx->timing,
+                                    NgxRequestTiming::kHeaderImport);
+          copy_response_headers_from_ngx(r, &response_headers);
+        }
+        ctx->recording_file_reader->Finish(&response_headers,
+                                           true /* complete response */);
+        ctx->recording_file_reader = NULL;
+        break;
+      }
+    }
+    return ngx_http_next_body_filter(r, in);
+  }
+#endif
+
   InPlaceResourceRecorder* recorder = ctx->recorder;
   for (ngx_chain_t* cl = in; cl; cl = cl->next) {
-    if (ngx_buf_size(cl->buf)) {
-      CHECK(ngx_buf_in_memory(cl->buf));
-      StringPiece contents(reinterpret_cast<char*>(cl->buf->pos),
-                           ngx_buf_size(cl->buf));
-      recorder->Write(contents, recorder->handler());
+    bool recorded = true;
+    if (ngx_buf_in_memory(cl->buf)) {
+      if (ngx_buf_size(cl->buf)) {
+        StringPiece contents(reinterpret_cast<char*>(cl->buf->pos),
+                             ngx_buf_size(cl->buf));
+        recorder->Write(contents, recorder->handler());
+      }
+    } else if (cl->buf->in_file && cl->buf->file_last > cl->buf->file_pos) {
+      // We asked for the body in memory, so this is data we can't see.
+      recorded = false;
     }
 
     if (cl->buf->flush) {
       recorder->Flush(recorder->handler());
     }
 
-    if (cl->buf->last_buf || recorder->failed()) {
+    if (cl->buf->last_buf || recorder->failed() || !recorded) {
       ResponseHeaders response_headers;
-      copy_response_headers_from_ngx(r, &response_headers);
-      ctx->recorder->DoneAndSetHeaders(
-          &response_headers,
-          cl->buf->last_buf /* response is complete if last_buf is set */);
-      ctx->recorder = NULL;
+      {
+        NgxScopedPhaseTimer timer(ctx->timing,
+                                  NgxRequestTiming::kHeaderImport);
+        copy_response_headers_from_ngx(r, &response_headers);
+      }
+      // The response is complete if last_buf is set and we got all of it.
+      ps_finish_recording(ctx, &response_headers,
+                          cl->buf->last_buf && recorded);
       break;
     }
   }
@@ -2639,12 +3310,21 @@ void ps_in_place_filter_init() {
 
 using in_place::ps_in_place_filter_init;
 
+// Sends the response.  If output_is_shared, output must outlive the request
+// and is sent without being copied.
 ngx_int_t send_out_headers_and_body(
     ngx_http_request_t* r,
     const ResponseHeaders& response_headers,
-    const GoogleString& output) {
-  ngx_int_t rc = copy_response_headers_to_ngx(
-      r, response_headers, kDontPreserveHeaders);
+    StringPiece output,
+    bool output_is_shared) {
+  ngx_int_t rc;
+  {
+    ps_request_ctx_t* ctx = ps_get_request_context(r);
+    NgxScopedPhaseTimer timer(ctx == NULL ? NULL : ctx->timing,
+                              NgxRequestTiming::kHeaderExport);
+    rc = copy_response_headers_to_ngx(r, response_headers,
+                                      kDontPreserveHeaders);
+  }
 
   if (rc != NGX_OK) {
     return NGX_ERROR;
@@ -2658,8 +3338,12 @@ ngx_int_t send_out_headers_and_body(
 
   // Send the body.
   ngx_chain_t* out;
-  rc = string_piece_to_buffer_chain(
-      r->pool, output, &out, true /* send_last_buf */, false);
+  if (output_is_shared) {
+    rc = string_piece_to_shared_buffer_chain(r->pool, output, &out);
+  } else {
+    rc = string_piece_to_buffer_chain(
+        r->pool, output, &out, true /* send_last_buf */, false);
+  }
   if (rc == NGX_ERROR) {
     return NGX_ERROR;
   }
@@ -2679,15 +3363,14 @@ ngx_int_t ps_simple_handler(ngx_http_request_t* r,
   NgxMessageHandler* message_handler = factory->ngx_message_handler();
   StringPiece request_uri_path = str_to_string_piece(r->uri);
 
-  GoogleString url_string = ps_determine_url(r);
-  GoogleUrl url(url_string);
-  QueryParams query_params;
-  if (url.IsWebValid()) {
-    query_params.ParseFromUrl(url);
-  }
-
   GoogleString output;
   StringWriter writer(&output);
+  // Static assets are served straight from the static asset manager's memory,
+  // which lives as long as the server context.
+  StringPiece static_output;
+  bool output_is_static = false;
+  bool output_is_gzipped = false;
+  bool vary_accept_encoding = false;
   HttpStatus::Code status = HttpStatus::kOK;
   ContentType content_type = kContentTypeHtml;
   StringPiece cache_control = HttpAttributes::kNoCache;
@@ -2695,13 +3378,30 @@ ngx_int_t ps_simple_handler(ngx_http_request_t* r,
 
   switch (response_category) {
     case RequestRouting::kStaticContent: {
-      StringPiece file_contents;
+      StringPiece file_name =
+          request_uri_path.substr(factory->static_asset_prefix().length());
       if (!server_context->static_asset_manager()->GetAsset(
-              request_uri_path.substr(factory->static_asset_prefix().length()),
-              &file_contents, &content_type, &cache_control)) {
+              file_name, &static_output, &content_type, &cache_control)) {
         return NGX_DECLINED;
       }
-      file_contents.CopyToString(&output);
+      output_is_static = true;
+#if (NGX_HTTP_GZIP)
+      // Like gzip_static: where gzip is on, clients that accept it get a copy
+      // we compressed once, instead of having the gzip filter compress the
+      // asset on every request.  The gzip filter leaves responses with a
+      // Content-Encoding alone.  Either variant may be cached for a long time,
+      // so both say they vary on Accept-Encoding whatever gzip_vary says.
+      if (g_gzip_setter.GZipOnForRequest(r)) {
+        vary_accept_encoding = true;
+        StringPiece gzipped;
+        if (ngx_http_gzip_ok(r) == NGX_OK &&
+            server_context->GetGzippedStaticAsset(
+                file_name, static_output, &gzipped)) {
+          static_output = gzipped;
+          output_is_gzipped = true;
+        }
+      }
+#endif
       break;
     }
     case RequestRouting::kMessages: {
@@ -2726,6 +3426,9 @@ ngx_int_t ps_simple_handler(ngx_http_request_t* r,
     status = HttpStatus::kNotFound;
     content_type = kContentTypeHtml;
     output = error_message;
+    output_is_static = false;
+    output_is_gzipped = false;
+    vary_accept_encoding = false;
   }
 
   ResponseHeaders response_headers;
@@ -2740,6 +3443,14 @@ ngx_int_t ps_simple_handler(ngx_http_request_t* r,
   // "X-Content-Type-Options: nosniff". This is a security feature
   // that helps prevent attacks based on MIME-type confusion.
   response_headers.Add("X-Content-Type-Options", "nosniff");
+  if (output_is_gzipped) {
+    response_headers.Add(HttpAttributes::kContentEncoding,
+                         HttpAttributes::kGzip);
+  }
+  if (vary_accept_encoding) {
+    response_headers.Add(HttpAttributes::kVary,
+                         HttpAttributes::kAcceptEncoding);
+  }
 
   int64 now_ms = factory->timer()->NowMs();
   response_headers.SetDate(now_ms);
@@ -2753,7 +3464,12 @@ ngx_int_t ps_simple_handler(ngx_http_request_t* r,
     }
   }
 
-  return send_out_headers_and_body(r, response_headers, output);
+  if (output_is_static) {
+    return send_out_headers_and_body(r, response_headers, static_output,
+                                     true /* output_is_shared */);
+  }
+  return send_out_headers_and_body(r, response_headers, output,
+                                   false /* output_is_shared */);
 }
 
 void ps_beacon_handler_helper(ngx_http_request_t* r,
@@ -2778,9 +3494,11 @@ void ps_beacon_handler_helper(ngx_http_request_t* r,
   request_context->set_options(
       cfg_s->server_context->global_options()->ComputeHttpOptions());
 
-  cfg_s->server_context->HandleBeacon(beacon_data,
-                                      user_agent,
-                                      request_context);
+  // The client gets its 204 either way; a beacon dropped under load only
+  // means some future rewrites aren't tuned by it.
+  cfg_s->server_context->QueueBeacon(beacon_data,
+                                     user_agent,
+                                     request_context);
 
   ps_set_cache_control(r, const_cast<char*>("max-age=0, no-cache"));
 
@@ -2788,98 +3506,66 @@ void ps_beacon_handler_helper(ngx_http_request_t* r,
   // header so wget doesn't hang.
 }
 
-// Load the request body into out.  ngx_http_read_client_request_body must
-// already have been called.  Return false on failure, true on success.
-bool ps_request_body_to_string_piece(
-    ngx_http_request_t* r, StringPiece* out) {
+// Loads the beacon data for a POSTed beacon into out: the query params, then
+// "&", then the request body.  It's gathered straight into one allocation from
+// the request's pool, reading any part of the body that nginx spilled to a
+// temp file directly into place, so the body is copied exactly once.
+// ngx_http_read_client_request_body must already have been called.  Return
+// false on failure, true on success.
+bool ps_request_body_to_beacon_data(
+    ngx_http_request_t* r, StringPiece query_params, StringPiece* out) {
   if (r->request_body == NULL || r->request_body->bufs == NULL) {
     ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                  "ps_request_body_to_string_piece: "
+                  "ps_request_body_to_beacon_data: "
                   "empty request body.");
     return false;
   }
 
-  if (r->request_body->temp_file) {
-    u_char buf[POST_BUF_READ_SIZE];
-    int count = 0;
-    ssize_t ret;
-    GoogleString tmp;
-
-    // Note that we depend on nginx to impose sensible limits on post data.
-    while ((ret = ngx_read_file(&r->request_body->temp_file->file,
-                                buf, POST_BUF_READ_SIZE, count)) > 0) {
-      tmp.append(reinterpret_cast<char*>(buf), ret);
-      count += ret;
-    }
-
-    if (ret < 0) {
-      ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                    "ps_request_body_to_string_piece: "
-                    "error reading post body.");
-      return false;
-    }
-
-    // We have read the complete post body, copy it to a buffer
-    // from the request's pool.
-    u_char* data = reinterpret_cast<u_char*>(ngx_palloc(r->pool, count));
-    memcpy(data, tmp.c_str(), count);
-    *out = StringPiece(reinterpret_cast<char*>(data), count);
-
-    return true;
-  } else if (r->request_body->bufs->next == NULL) {
-    // There's just one buffer, so we can simply return a StringPiece pointing
-    // to this buffer.
-    ngx_buf_t* buffer = r->request_body->bufs->buf;
-    CHECK(!buffer->in_file);
-    int len = buffer->last - buffer->pos;
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                  "ngx_pagespeed beacon: single buffer of %d", len);
-    *out = StringPiece(reinterpret_cast<char*>(buffer->pos), len);
-    return true;
-  } else {
-    // There are multiple buffers, so we need to allocate memory for a string to
-    // hold the whole result.  This should only happen when the POST is sent
-    // with "Transfer-Encoding: Chunked".
-
-    // First determine how much data there is.
-    int len = 0;
-    int buffers = 0;
-
-    ngx_chain_t* chain_link;
-    for (chain_link = r->request_body->bufs;
-         chain_link != NULL;
-         chain_link = chain_link->next) {
-      len += chain_link->buf->last - chain_link->buf->pos;
-      buffers++;
-    }
+  // Note that we depend on nginx to impose sensible limits on post data.
+  size_t len = query_params.size() + 1;
+  ngx_chain_t* chain_link;
+  for (chain_link = r->request_body->bufs;
+       chain_link != NULL;
+       chain_link = chain_link->next) {
+    len += ngx_buf_size(chain_link->buf);
+  }
 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                  "ngx_pagespeed beacon: %d buffers totalling %d", len);
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "ngx_pagespeed beacon: %uz bytes", len);
 
-    // Allocate a string to store the combined result.
-    u_char* s = static_cast<u_char*>(ngx_palloc(r->pool, len));
-    if (s == NULL) {
-      ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                    "ps_request_body_to_string_piece: "
-                    "failed to allocate memory");
-      return false;
-    }
+  u_char* data = static_cast<u_char*>(ngx_pnalloc(r->pool, len));
+  if (data == NULL) {
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "ps_request_body_to_beacon_data: "
+                  "failed to allocate memory");
+    return false;
+  }
 
-    // Copy the data into the combined string.
-    u_char* current_position = s;
-    int i;
-    for (chain_link = r->request_body->bufs, i = 0;
-         chain_link != NULL;
-         chain_link = chain_link->next, i++) {
-      ngx_buf_t* buffer = chain_link->buf;
-      CHECK(!buffer->in_file);
+  u_char* current_position = ngx_copy(
+      data, query_params.data(), query_params.size());
+  *current_position++ = '&';
+  for (chain_link = r->request_body->bufs;
+       chain_link != NULL;
+       chain_link = chain_link->next) {
+    ngx_buf_t* buffer = chain_link->buf;
+    if (ngx_buf_in_memory(buffer)) {
       current_position = ngx_copy(current_position, buffer->pos,
                                   buffer->last - buffer->pos);
+    } else if (buffer->in_file) {
+      ssize_t size = buffer->file_last - buffer->file_pos;
+      if (ngx_read_file(buffer->file, current_position, size,
+                        buffer->file_pos) != size) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "ps_request_body_to_beacon_data: "
+                      "error reading post body.");
+        return false;
+      }
+      current_position += size;
     }
-    CHECK_EQ(current_position, s + len);
-    *out = StringPiece(reinterpret_cast<char*>(s), len);
-    return true;
   }
+  CHECK_EQ(current_position, data + len);
+  *out = StringPiece(reinterpret_cast<char*>(data), len);
+  return true;
 }
 
 // Parses out query params from the request.
@@ -2894,6 +3580,58 @@ void ps_query_params_handler(ngx_http_request_t* r, StringPiece* data) {
   }
 }
 
+// Returns whether a beacon of the same kind for the same page was accepted
+// recently enough that this one should be dropped.  Beacons name their page in
+// the url param, and the hash of the options that served it in oh.  Each
+// filter's beacon carries its own data params, such as ci for critical images
+// or cs for critical css, so their names tell the kinds apart.  The nonce in n
+// differs every time and is left out.  Escaped values are hashed as is, since
+// they only have to match what the same page's other beacons send.
+bool ps_beacon_rate_limited(ngx_http_request_t* r, ps_srv_conf_t* cfg_s,
+                            StringPiece beacon_data) {
+  int64 interval_ms = cfg_s->server_context->config()->beacon_rate_limit_ms();
+  if (interval_ms <= 0) {
+    return false;
+  }
+
+  StringPieceVector params;
+  SplitStringPieceToVector(beacon_data, "&", &params,
+                           true /* omit_empty_strings */);
+  StringPiece page_url;
+  StringPiece options_hash;
+  StringPieceVector kinds;
+  for (int i = 0, n = params.size(); i < n; ++i) {
+    StringPiece name = params[i];
+    StringPiece value;
+    stringpiece_ssize_type equals = name.find('=');
+    if (equals != StringPiece::npos) {
+      value = name.substr(equals + 1);
+      name = name.substr(0, equals);
+    }
+    if (name == "url") {
+      page_url = value;
+    } else if (name == "oh") {
+      options_hash = value;
+    } else if (name != "n") {
+      kinds.push_back(name);
+    }
+  }
+  if (page_url.empty()) {
+    return false;
+  }
+
+  std::sort(kinds.begin(), kinds.end());
+  GoogleString key = StrCat(page_url, " ", options_hash);
+  for (int i = 0, n = kinds.size(); i < n; ++i) {
+    StrAppend(&key, " ", kinds[i]);
+  }
+  ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+      ngx_http_get_module_main_conf(r, ngx_pagespeed));
+  int64 now_ms = ps_cached_now_ms();
+  return !cfg_m->beacon_rate_limits->Claim(
+      NgxSharedHashTable::HashKey(key), now_ms, now_ms + interval_ms);
+}
+
 // Called after nginx reads the request body from the client.  For another
 // example processing request buffers, see ngx_http_form_input_module.c
 void ps_beacon_body_handler(ngx_http_request_t* r) {
@@ -2902,12 +3640,16 @@ void ps_beacon_body_handler(ngx_http_request_t* r) {
   StringPiece query_param_beacon_data;
   ps_query_params_handler(r, &query_param_beacon_data);
 
-  StringPiece request_body;
-  bool ok = ps_request_body_to_string_piece(r, &request_body);
-  GoogleString beacon_data = StrCat(
-      query_param_beacon_data, "&", request_body);
-  if (ok) {
-    ps_beacon_handler_helper(r, beacon_data.c_str());
+  StringPiece beacon_data;
+  if (ps_request_body_to_beacon_data(r, query_param_beacon_data,
+                                     &beacon_data)) {
+    if (ps_beacon_rate_limited(r, ps_get_srv_config(r), beacon_data)) {
+      ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                     "ps_beacon_body_handler: rate limited");
+      ps_set_cache_control(r, const_cast<char*>("max-age=0, no-cache"));
+    } else {
+      ps_beacon_handler_helper(r, beacon_data);
+    }
     ngx_http_finalize_request(r, NGX_HTTP_NO_CONTENT);
   } else {
     ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -2935,7 +3677,14 @@ ngx_int_t ps_beacon_handler(ngx_http_request_t* r) {
     // Use query params.
     StringPiece query_param_beacon_data;
     ps_query_params_handler(r, &query_param_beacon_data);
-    ps_beacon_handler_helper(r, query_param_beacon_data);
+    if (ps_beacon_rate_limited(r, ps_get_srv_config(r),
+                               query_param_beacon_data)) {
+      ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                     "ps_beacon_handler: rate limited");
+      ps_set_cache_control(r, const_cast<char*>("max-age=0, no-cache"));
+    } else {
+      ps_beacon_handler_helper(r, query_param_beacon_data);
+    }
     return NGX_HTTP_NO_CONTENT;
   }
 }
@@ -2953,9 +3702,6 @@ ngx_int_t ps_content_handler(ngx_http_request_t* r) {
     return NGX_DECLINED;
   }
 
-  // Poll for cache flush on every request (polls are rate-limited).
-  cfg_s->server_context->FlushCacheIfNecessary();
-
   ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "http pagespeed handler \"%V\"", &r->uri);
 
@@ -2980,7 +3726,12 @@ ngx_int_t ps_content_handler(ngx_http_request_t* r) {
     case RequestRouting::kAdmin:
     case RequestRouting::kGlobalAdmin:
     case RequestRouting::kCachePurge:
+      return ps_resource_handler(
+          r, false /* html rewrite */, response_category);
     case RequestRouting::kResource:
+      if (ps_can_decline_early(r, cfg_s, *ps_get_request_context(r)->url)) {
+        return NGX_DECLINED;
+      }
       return ps_resource_handler(
           r, false /* html rewrite */, response_category);
   }
@@ -3105,6 +3856,14 @@ ngx_int_t ps_pre_init(ngx_conf_t* cf) {
   // Setup an intervention setter for gzip configuration and check
   // gzip configuration command signatures.
   g_gzip_setter.Init(cf);
+
+  ngx_str_t name = ngx_string("pagespeed_timing");
+  ngx_http_variable_t* var =
+      ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+  if (var == NULL) {
+    return NGX_ERROR;
+  }
+  var->get_handler = ps_timing_variable;
   return NGX_OK;
 }
 
@@ -3124,6 +3883,27 @@ ngx_int_t ps_init(ngx_conf_t* cf) {
   // filter, and content handler will run in every server block.  This is ok,
   // because they will notice that the server context is NULL and do nothing.
   if (cfg_m->driver_factory != NULL) {
+    cfg_m->ipro_recordings = NgxSharedHashTable::Create(
+        cf, "pagespeed_ipro_recordings", kIproRecordingSlots, &ngx_pagespeed);
+    cfg_m->ipro_negative_lookups = NgxSharedHashTable::Create(
+        cf, "pagespeed_ipro_negative_lookups", kIproNegativeLookupSlots,
+        &ngx_pagespeed);
+    cfg_m->beacon_rate_limits = NgxSharedHashTable::Create(
+        cf, "pagespeed_beacon_rate_limits", kBeaconRateLimitSlots,
+        &ngx_pagespeed);
+    if (cfg_m->ipro_recordings == NULL ||
+        cfg_m->ipro_negative_lookups == NULL ||
+        cfg_m->beacon_rate_limits == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_str_t timing_name = ngx_string("pagespeed_timing");
+    cfg_m->timing_variable_index =
+        ngx_http_get_variable_index(cf, &timing_name);
+    if (cfg_m->timing_variable_index == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+
     // The filter init order is important.
     ps_in_place_filter_init();
 
@@ -3256,11 +4036,40 @@ void ps_exit_child_process(ngx_cycle_t* cycle) {
   ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
       ngx_http_cycle_get_module_main_conf(cycle, ngx_pagespeed));
   NgxBaseFetch::Terminate();
+  NgxOutputCompressor::Terminate();
   if (cfg_m != NULL && cfg_m->driver_factory != NULL) {
     cfg_m->driver_factory->ShutDown();
   }
 }
 
+// How often each worker checks whether its server blocks are due to poll for
+// a cache flush.  Each still polls at its own CacheFlushPollIntervalSec.
+const ngx_msec_t kCacheFlushTimerMs = 1000;
+ngx_event_t ps_cache_flush_event;
+
+// Polls for cache flushes from a timer rather than on each request, so
+// requests never stat the cache flush file.
+void ps_cache_flush_handler(ngx_event_t* ev) {
+  if (ngx_terminate || ngx_exiting) {
+    return;
+  }
+
+  ngx_cycle_t* cycle = const_cast<ngx_cycle_t*>(ngx_cycle);
+  ngx_http_core_main_conf_t* cmcf = static_cast<ngx_http_core_main_conf_t*>(
+      ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module));
+  ngx_http_core_srv_conf_t** cscfp = static_cast<ngx_http_core_srv_conf_t**>(
+      cmcf->servers.elts);
+  for (ngx_uint_t s = 0; s < cmcf->servers.nelts; s++) {
+    ps_srv_conf_t* cfg_s = static_cast<ps_srv_conf_t*>(
+        cscfp[s]->ctx->srv_conf[ngx_pagespeed.ctx_index]);
+    if (cfg_s->server_context != NULL) {
+      cfg_s->server_context->PollCacheFlush();
+    }
+  }
+
+  ngx_add_timer(ev, kCacheFlushTimerMs);
+}
+
 // Called when nginx forks worker processes.  No threads should be started
 // before this.
 ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
@@ -3302,6 +4111,22 @@ ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
   }
 
   cfg_m->driver_factory->StartThreads();
+
+  // Start fetching remote configuration now, so it's usually in place by the
+  // time the first requests arrive.
+  for (s = 0; s < cmcf->servers.nelts; s++) {
+    ps_srv_conf_t* cfg_s = static_cast<ps_srv_conf_t*>(
+        cscfp[s]->ctx->srv_conf[ngx_pagespeed.ctx_index]);
+    ps_determine_remote_options(cfg_s);
+  }
+
+  ps_cache_flush_event.handler = ps_cache_flush_handler;
+  ps_cache_flush_event.log = cycle->log;
+#if (nginx_version >= 1007005)
+  // Don't hold up a graceful shutdown waiting for the next poll.
+  ps_cache_flush_event.cancelable = 1;
+#endif
+  ngx_add_timer(&ps_cache_flush_event, kCacheFlushTimerMs);
   return NGX_OK;
 }
 
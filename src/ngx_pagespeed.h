@@ -37,11 +37,13 @@ extern "C" {
 }
 
 #include "base/logging.h"
+#include "net/instaweb/http/public/request_context.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/http/response_headers.h"
 
 namespace net_instaweb {
 
+class GoogleUrl;
 class GzipInflater;
 class NgxBaseFetch;
 class ProxyFetch;
@@ -49,6 +51,8 @@ class RewriteDriver;
 class RequestHeaders;
 class ResponseHeaders;
 class InPlaceResourceRecorder;
+class NgxRecordingFileReader;
+class NgxRequestTiming;
 
 // Allocate chain links and buffers from the supplied pool, and copy over the
 // data from the string piece.  If the string piece is empty, return
@@ -57,6 +61,11 @@ ngx_int_t string_piece_to_buffer_chain(
     ngx_pool_t* pool, StringPiece sp,
     ngx_chain_t** link_ptr, bool send_last_buf, bool send_flush);
 
+// Build a single-link chain whose buffer references sp without copying it.
+// sp must stay valid until the request is finalized.
+ngx_int_t string_piece_to_shared_buffer_chain(
+    ngx_pool_t* pool, StringPiece sp, ngx_chain_t** link_ptr);
+
 StringPiece str_to_string_piece(ngx_str_t s);
 
 // s1: ngx_str_t, s2: string literal
@@ -84,6 +93,26 @@ enum PreserveCachingHeaders {
   kDontPreserveHeaders,
 };
 
+namespace RequestRouting {
+enum Response {
+  kError,
+  kStaticContent,
+  kInvalidUrl,
+  kPagespeedDisabled,
+  kBeacon,
+  kStatistics,
+  kGlobalStatistics,
+  kConsole,
+  kMessages,
+  kAdmin,
+  kCachePurge,
+  kGlobalAdmin,
+  kPagespeedSubrequest,
+  kErrorResponse,
+  kResource,
+};
+}  // namespace RequestRouting
+
 typedef struct {
   NgxBaseFetch* base_fetch;
 
@@ -101,18 +130,52 @@ typedef struct {
   // for in place resource
   RewriteDriver* driver;
   InPlaceResourceRecorder* recorder;
+  // Takes over recorder once a recorded response turns out to be sent from a
+  // file, on locations with aio threads.
+  NgxRecordingFileReader* recording_file_reader;
+  // What a miss needs from the lookup's driver and options, captured when
+  // the lookup starts so the driver can go back to the pool as soon as the
+  // lookup is over.
+  RequestContextPtr ipro_request_context;
+  GoogleString ipro_cache_fragment;
+  int64 ipro_max_response_bytes;
+  int ipro_max_concurrent_recordings;
+  // Identifies this resource in the tables of recordings in progress and of
+  // unrewritable lookups.
+  uint64 recording_key;
+  // The expiry of our claim on recording_key, which tells our claim apart
+  // from a later one if ours runs out.
+  int64 recording_expires_ms;
+  // How long to remember that the IPRO lookup found this resource can't be
+  // rewritten, or 0 not to.
+  int64 ipro_negative_ttl_ms;
   ResponseHeaders* ipro_response_headers;
 
+  // Request headers the content phase imported before passing on a request
+  // that may still turn out to be html, kept so the header filter doesn't
+  // copy them out of nginx a second time.  Owned by the context.
+  RequestHeaders* request_headers;
+
   // We need to remember the URL here as well since we may modify what NGX
   // gets by stripping our special query params and honoring X-Forwarded-Proto.
   GoogleString url_string;
 
+  // The request URL as nginx gave it to us, parsed once when the request is
+  // routed, and the routing decision made from it.  Later phases reuse these
+  // instead of rebuilding and reparsing the URL.  Owned by the context.
+  GoogleUrl* url;
+  RequestRouting::Response routing;
+
   // We need to remember if the upstream had headers_out->location set, because
   // we should mirror that when we write it back. nginx may absolutify
   // Location: headers that start with '/' without regarding X-Forwarded-Proto.
   bool location_field_set;
   bool psol_vary_accept_only;
   bool follow_flushes;
+
+  // Time spent in each phase, if RequestPhaseTiming is on.  Owned by the
+  // context.
+  NgxRequestTiming* timing;
 } ps_request_ctx_t;
 
 ps_request_ctx_t* ps_get_request_context(ngx_http_request_t* r);
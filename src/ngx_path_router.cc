@@ -0,0 +1,112 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "ngx_path_router.h"
+
+#include "base/logging.h"
+
+namespace net_instaweb {
+
+NgxPathRouter::NgxPathRouter() : nodes_(1) {
+}
+
+NgxPathRouter::~NgxPathRouter() {
+}
+
+void NgxPathRouter::Add(StringPiece path, MatchType type, bool case_sensitive,
+                        int id) {
+  DCHECK(id >= 0 && id <= kMaxRouteId);
+  if (path.empty() ||
+      (type == kDirectory && path[path.size() - 1] != '/')) {
+    return;
+  }
+
+  int node = 0;
+  for (size_t i = 0; i < path.size(); ++i) {
+    char c = LowerChar(path[i]);
+    int next = Child(node, c);
+    if (next < 0) {
+      next = nodes_.size();
+      // Don't hold a reference into nodes_ across this push_back.
+      nodes_.push_back(Node());
+      nodes_[node].children.push_back(std::make_pair(c, next));
+    }
+    node = next;
+  }
+
+  Route route;
+  path.CopyToString(&route.path);
+  route.type = type;
+  route.case_sensitive = case_sensitive;
+  route.id = id;
+  nodes_[node].routes.push_back(routes_.size());
+  routes_.push_back(route);
+}
+
+uint32 NgxPathRouter::Lookup(StringPiece path) const {
+  uint32 matches = 0;
+  int node = 0;
+  for (size_t depth = 0; node >= 0; ++depth) {
+    matches |= MatchesAt(nodes_[node], path, depth);
+    if (depth == path.size()) {
+      break;
+    }
+    node = Child(node, LowerChar(path[depth]));
+  }
+  return matches;
+}
+
+int NgxPathRouter::Child(int node, char c) const {
+  const std::vector<std::pair<char, int> >& children = nodes_[node].children;
+  for (int i = 0, n = children.size(); i < n; ++i) {
+    if (children[i].first == c) {
+      return children[i].second;
+    }
+  }
+  return -1;
+}
+
+uint32 NgxPathRouter::MatchesAt(const Node& node, StringPiece path,
+                                size_t depth) const {
+  uint32 matches = 0;
+  for (int i = 0, n = node.routes.size(); i < n; ++i) {
+    const Route& route = routes_[node.routes[i]];
+    switch (route.type) {
+      case kExact:
+        if (depth != path.size()) {
+          continue;
+        }
+        break;
+      case kPrefix:
+        break;
+      case kDirectory:
+        if (path.find('/', depth) != StringPiece::npos) {
+          continue;
+        }
+        break;
+    }
+    if (route.case_sensitive && path.substr(0, depth) != route.path) {
+      continue;
+    }
+    matches |= 1u << route.id;
+  }
+  return matches;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,91 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Matches request paths against the paths pagespeed serves itself (admin
+// pages, statistics, beacons, static assets) with a single walk down a
+// case-insensitive trie, instead of comparing the request path against each
+// configured path in turn.  Built once per server block at configuration
+// time and only read afterwards.
+
+#ifndef NGX_PATH_ROUTER_H_
+#define NGX_PATH_ROUTER_H_
+
+#include <utility>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class NgxPathRouter {
+ public:
+  enum MatchType {
+    kExact,      // The request path equals the route path.
+    kPrefix,     // The request path starts with the route path.
+    kDirectory,  // The route path, which ends in '/', is the request path with
+                 // its leaf removed.
+  };
+
+  // Route ids are bit positions in the result of Lookup().
+  static const int kMaxRouteId = 31;
+
+  NgxPathRouter();
+  ~NgxPathRouter();
+
+  // Adds a route from path to id, 0 <= id <= kMaxRouteId.  Matching ignores
+  // ASCII case unless case_sensitive.  Empty paths never match, so they are
+  // not added, and neither are kDirectory paths that don't end in '/'.
+  void Add(StringPiece path, MatchType type, bool case_sensitive, int id);
+
+  // Returns a bitmask with bit id set for each route that matches path, which
+  // should not include the query string.
+  uint32 Lookup(StringPiece path) const;
+
+ private:
+  struct Route {
+    GoogleString path;
+    MatchType type;
+    bool case_sensitive;
+    int id;
+  };
+
+  struct Node {
+    // (lowercased character, node index), usually only one or two entries.
+    std::vector<std::pair<char, int> > children;
+    // Indexes into routes_ of the routes whose paths end at this node.
+    std::vector<int> routes;
+  };
+
+  int Child(int node, char c) const;
+  // Returns the bits of the routes at node that match path, given that the
+  // first depth characters of path led to node.
+  uint32 MatchesAt(const Node& node, StringPiece path, size_t depth) const;
+
+  std::vector<Node> nodes_;
+  std::vector<Route> routes_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxPathRouter);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_PATH_ROUTER_H_
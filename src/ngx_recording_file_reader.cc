@@ -0,0 +1,195 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "ngx_recording_file_reader.h"
+
+#if (NGX_THREADS)
+
+#include <unistd.h>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/http/response_headers.h"
+#include "pagespeed/system/in_place_resource_recorder.h"
+
+namespace net_instaweb {
+
+// A piece of the response, in order.  Read from a file if fd is valid.
+struct NgxRecordingFileReader::Chunk {
+  explicit Chunk(NgxRecordingFileReader* reader)
+      : reader(reader),
+        fd(NGX_INVALID_FILE),
+        offset(0),
+        size(0),
+        data(NULL),
+        pending(false),
+        failed(false),
+        flush(false) {
+    ngx_memzero(&task, sizeof(task));
+  }
+  ~Chunk() {
+    delete[] data;
+  }
+
+  ngx_thread_task_t task;
+  NgxRecordingFileReader* reader;
+  ngx_fd_t fd;
+  off_t offset;
+  size_t size;
+  char* data;
+  // Set while the thread pool is reading into data.
+  bool pending;
+  bool failed;
+  bool flush;
+};
+
+NgxRecordingFileReader::NgxRecordingFileReader(
+    InPlaceResourceRecorder* recorder, ngx_thread_pool_t* thread_pool,
+    int64 max_bytes, Function* done)
+    : recorder_(recorder),
+      thread_pool_(thread_pool),
+      max_bytes_(max_bytes),
+      bytes_seen_(0),
+      done_(done),
+      failed_(false),
+      finished_(false),
+      complete_(false) {
+}
+
+NgxRecordingFileReader::~NgxRecordingFileReader() {
+  DCHECK(chunks_.empty());
+}
+
+void NgxRecordingFileReader::Add(ngx_buf_t* buf) {
+  DCHECK(!finished_);
+  Chunk* chunk = new Chunk(this);
+  chunk->flush = buf->flush;
+
+  if (ngx_buf_in_memory(buf)) {
+    chunk->size = ngx_buf_size(buf);
+    if (chunk->size > 0) {
+      chunk->data = new char[chunk->size];
+      ngx_memcpy(chunk->data, buf->pos, chunk->size);
+    }
+  } else if (buf->in_file && buf->file_last > buf->file_pos) {
+    chunk->size = buf->file_last - buf->file_pos;
+    chunk->offset = buf->file_pos;
+    // There's no point reading what the recorder will throw away.
+    if (failed_ || recorder_->failed() ||
+        (max_bytes_ > 0 &&
+         bytes_seen_ + static_cast<int64>(chunk->size) > max_bytes_)) {
+      chunk->failed = true;
+    } else {
+      chunk->fd = dup(buf->file->fd);
+      if (chunk->fd == NGX_INVALID_FILE) {
+        chunk->failed = true;
+      } else {
+        chunk->data = new char[chunk->size];
+        chunk->task.ctx = chunk;
+        chunk->task.handler = Read;
+        chunk->task.event.data = chunk;
+        chunk->task.event.handler = ReadDone;
+        chunk->task.event.log = ngx_cycle->log;
+        chunk->pending = true;
+        if (ngx_thread_task_post(thread_pool_, &chunk->task) != NGX_OK) {
+          ngx_close_file(chunk->fd);
+          chunk->fd = NGX_INVALID_FILE;
+          chunk->pending = false;
+          chunk->failed = true;
+        }
+      }
+    }
+  }
+  bytes_seen_ += chunk->size;
+
+  chunks_.push_back(chunk);
+  WriteReadyChunks();
+}
+
+void NgxRecordingFileReader::Finish(const ResponseHeaders* response_headers,
+                                    bool complete) {
+  DCHECK(!finished_);
+  finished_ = true;
+  complete_ = complete;
+  if (response_headers != NULL) {
+    response_headers_.reset(new ResponseHeaders);
+    response_headers_->CopyFrom(*response_headers);
+  }
+  WriteReadyChunks();
+}
+
+void NgxRecordingFileReader::Read(void* data, ngx_log_t* log) {
+  Chunk* chunk = static_cast<Chunk*>(data);
+  size_t done = 0;
+  while (done < chunk->size) {
+    ssize_t n = pread(chunk->fd, chunk->data + done,
+                      chunk->size - done, chunk->offset + done);
+    if (n == -1 && ngx_errno == NGX_EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // A read error, or the file was truncated while we were sending it.
+      chunk->failed = true;
+      return;
+    }
+    done += n;
+  }
+}
+
+void NgxRecordingFileReader::ReadDone(ngx_event_t* ev) {
+  Chunk* chunk = static_cast<Chunk*>(ev->data);
+  ngx_close_file(chunk->fd);
+  chunk->fd = NGX_INVALID_FILE;
+  chunk->pending = false;
+  chunk->reader->WriteReadyChunks();
+}
+
+void NgxRecordingFileReader::WriteReadyChunks() {
+  while (!chunks_.empty() && !chunks_.front()->pending) {
+    Chunk* chunk = chunks_.front();
+    chunks_.pop_front();
+    if (chunk->failed) {
+      failed_ = true;
+    } else if (!failed_ && !recorder_->failed()) {
+      if (chunk->size > 0) {
+        recorder_->Write(StringPiece(chunk->data, chunk->size),
+                         recorder_->handler());
+      }
+      if (chunk->flush) {
+        recorder_->Flush(recorder_->handler());
+      }
+    }
+    delete chunk;
+  }
+
+  if (finished_ && chunks_.empty()) {
+    // The recorder deletes itself.
+    bool complete =
+        complete_ && !failed_ && response_headers_.get() != NULL;
+    recorder_->DoneAndSetHeaders(response_headers_.get(), complete);
+    recorder_ = NULL;
+    done_->CallRun();
+    delete this;
+  }
+}
+
+}  // namespace net_instaweb
+
+#endif  // NGX_THREADS
@@ -0,0 +1,109 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Feeds an IPRO recording from a response nginx is sending from a file, so
+// the client keeps sendfile while the recorder gets a copy.  The file regions
+// are read on the location's aio thread pool, never on the event loop, and
+// handed to the recorder on the event loop in the order the response had them.
+//
+// A recording can outlive the request that started it: the client may have
+// its response before the last read comes back.  The reader owns the recorder
+// and deletes itself once the request has finished with it and every read it
+// started has returned.  It reads from its own duplicates of the response's
+// file descriptors, so nginx may close the files whenever it likes.
+
+#ifndef NGX_RECORDING_FILE_READER_H_
+#define NGX_RECORDING_FILE_READER_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+}
+
+#include <deque>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+
+namespace net_instaweb {
+
+class Function;
+class InPlaceResourceRecorder;
+class ResponseHeaders;
+
+#if (NGX_THREADS)
+
+class NgxRecordingFileReader {
+ public:
+  // Takes ownership of recorder and of done, which is run once the recorder
+  // has been finished.  Gives up on reading once more than max_bytes have gone
+  // by, unless max_bytes is 0 or less.
+  NgxRecordingFileReader(InPlaceResourceRecorder* recorder,
+                         ngx_thread_pool_t* thread_pool, int64 max_bytes,
+                         Function* done);
+
+  // Passes buf's contents on to the recorder: in-memory contents are copied
+  // now, and file contents are read on the thread pool.
+  void Add(ngx_buf_t* buf);
+
+  // Called once the request is done with the recording, with the response's
+  // headers (or NULL), and whether the whole response went by.  The recorder
+  // is finished once the outstanding reads are back, after which the reader
+  // deletes itself.
+  void Finish(const ResponseHeaders* response_headers, bool complete);
+
+ private:
+  struct Chunk;
+
+  ~NgxRecordingFileReader();
+
+  // Runs on the thread pool.
+  static void Read(void* data, ngx_log_t* log);
+  // Runs on the event loop once Read() is done.
+  static void ReadDone(ngx_event_t* ev);
+
+  // Writes the chunks at the front of the queue whose contents are ready to
+  // the recorder, and finishes up if that was the last of them.
+  void WriteReadyChunks();
+
+  InPlaceResourceRecorder* recorder_;
+  ngx_thread_pool_t* thread_pool_;
+  int64 max_bytes_;
+  int64 bytes_seen_;
+  Function* done_;
+  std::deque<Chunk*> chunks_;
+  // Set if any chunk couldn't be read, so the recording is incomplete.
+  bool failed_;
+  bool finished_;
+  bool complete_;
+  scoped_ptr<ResponseHeaders> response_headers_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxRecordingFileReader);
+};
+
+#endif  // NGX_THREADS
+
+}  // namespace net_instaweb
+
+#endif  // NGX_RECORDING_FILE_READER_H_
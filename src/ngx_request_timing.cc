@@ -0,0 +1,81 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "ngx_request_timing.h"
+
+#include <time.h>
+
+#include "pagespeed/kernel/base/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Indexed by NgxRequestTiming::Phase.
+const char* const kPhaseNames[] = {
+  "route", "options", "import", "write", "collect", "export",
+};
+
+const char* const kPhaseHistograms[] = {
+  "Ngx Route Time us Histogram",
+  "Ngx Options Time us Histogram",
+  "Ngx Header Import Time us Histogram",
+  "Ngx Psol Write Time us Histogram",
+  "Ngx Collect Writes Time us Histogram",
+  "Ngx Header Export Time us Histogram",
+};
+
+}  // namespace
+
+NgxRequestTiming::NgxRequestTiming() {
+  for (int i = 0; i < kNumPhases; ++i) {
+    us_[i] = 0;
+  }
+}
+
+void NgxRequestTiming::InitStats(Statistics* statistics) {
+  for (int i = 0; i < kNumPhases; ++i) {
+    statistics->AddHistogram(kPhaseHistograms[i]);
+  }
+}
+
+int64 NgxRequestTiming::NowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void NgxRequestTiming::Record(Statistics* statistics) const {
+  for (int i = 0; i < kNumPhases; ++i) {
+    // Requests skip most phases; only count the ones they went through.
+    if (us_[i] > 0) {
+      statistics->GetHistogram(kPhaseHistograms[i])->Add(us_[i]);
+    }
+  }
+}
+
+u_char* NgxRequestTiming::Format(u_char* buf) const {
+  u_char* p = buf;
+  for (int i = 0; i < kNumPhases; ++i) {
+    p = ngx_sprintf(p, i == 0 ? "%s=%L" : " %s=%L", kPhaseNames[i], us_[i]);
+  }
+  return p;
+}
+
+}  // namespace net_instaweb
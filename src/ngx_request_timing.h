@@ -0,0 +1,106 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Per-request accounting of the time ngx_pagespeed spends in each phase of its
+// work on the nginx thread, so worker CPU can be attributed to a phase.  The
+// phases are all synchronous, so their wall-clock time is the CPU time they
+// cost the worker.  Totals are added to a histogram per phase when the request
+// finishes, and can be logged through the $pagespeed_timing variable.
+//
+// Timing is only done when RequestPhaseTiming is on; otherwise requests have
+// no NgxRequestTiming and the scoped timers do nothing.
+
+#ifndef NGX_REQUEST_TIMING_H_
+#define NGX_REQUEST_TIMING_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+class Statistics;
+
+class NgxRequestTiming {
+ public:
+  enum Phase {
+    kRoute,          // Building and classifying the request URL.
+    kOptions,        // Resolving the options for the request.
+    kHeaderImport,   // Copying headers from nginx into PSOL.
+    kPsolWrite,      // Passing html to PSOL for rewriting.
+    kCollectWrites,  // Taking rewritten output back from PSOL.
+    kHeaderExport,   // Copying headers from PSOL back into nginx.
+    kNumPhases
+  };
+
+  NgxRequestTiming();
+
+  static void InitStats(Statistics* statistics);
+
+  // Monotonic time in microseconds.
+  static int64 NowUs();
+
+  void Add(Phase phase, int64 us) { us_[phase] += us; }
+
+  // Adds this request's time in each phase it went through to the phase's
+  // histogram.
+  void Record(Statistics* statistics) const;
+
+  // Writes "route=12 options=40 ..." in microseconds into buf, returning the
+  // end of what was written.  kMaxFormattedSize is always enough.
+  u_char* Format(u_char* buf) const;
+  static const size_t kMaxFormattedSize =
+      kNumPhases * (sizeof(" options=") + NGX_INT64_LEN);
+
+ private:
+  int64 us_[kNumPhases];
+
+  DISALLOW_COPY_AND_ASSIGN(NgxRequestTiming);
+};
+
+// Adds the time until it goes out of scope to a phase of timing, if timing
+// isn't NULL.
+class NgxScopedPhaseTimer {
+ public:
+  NgxScopedPhaseTimer(NgxRequestTiming* timing, NgxRequestTiming::Phase phase)
+      : timing_(timing),
+        phase_(phase),
+        start_us_(timing == NULL ? 0 : NgxRequestTiming::NowUs()) {
+  }
+  ~NgxScopedPhaseTimer() {
+    if (timing_ != NULL) {
+      timing_->Add(phase_, NgxRequestTiming::NowUs() - start_us_);
+    }
+  }
+
+ private:
+  NgxRequestTiming* timing_;
+  NgxRequestTiming::Phase phase_;
+  int64 start_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxScopedPhaseTimer);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_REQUEST_TIMING_H_
@@ -24,7 +24,10 @@
 #include <cstdio>
 
 #include "log_message_handler.h"
+#include "ngx_fetch_origins.h"
 #include "ngx_message_handler.h"
+#include "ngx_output_compressor.h"
+#include "ngx_request_timing.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
 #include "ngx_url_async_fetcher.h"
@@ -47,6 +50,7 @@
 #include "pagespeed/kernel/sharedmem/shared_circular_buffer.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_statistics.h"
 #include "pagespeed/kernel/thread/pthread_shared_mem.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
 #include "pagespeed/kernel/thread/scheduler_thread.h"
 #include "pagespeed/kernel/thread/slow_worker.h"
 #include "pagespeed/system/in_place_resource_recorder.h"
@@ -118,6 +122,7 @@ UrlAsyncFetcher* NgxRewriteDriverFactory::AllocateFetcher(
         config->blocking_fetch_timeout_ms(),
         resolver_,
         native_fetcher_max_keepalive_requests_,
+        native_fetcher_origins_.get(),
         thread_system(),
         message_handler());
     ngx_url_async_fetchers_.push_back(fetcher);
@@ -163,6 +168,15 @@ RewriteOptions* NgxRewriteDriverFactory::NewRewriteOptionsForQuery() {
   return new NgxRewriteOptions(thread_system());
 }
 
+bool NgxRewriteDriverFactory::AddNativeFetcherOrigin(
+    StringPiece domain, StringPiece target, StringPiece balancing,
+    GoogleString* error) {
+  if (native_fetcher_origins_.get() == NULL) {
+    native_fetcher_origins_.reset(new NgxFetchOrigins);
+  }
+  return native_fetcher_origins_->Add(domain, target, balancing, error);
+}
+
 bool NgxRewriteDriverFactory::CheckResolver() {
   if (use_native_fetcher_ && resolver_ == NULL) {
     return false;
@@ -191,6 +205,13 @@ ServerContext* NgxRewriteDriverFactory::NewServerContext() {
 void NgxRewriteDriverFactory::ShutDown() {
   if (!shut_down_) {
     shut_down_ = true;
+    // Let background work finish before the server contexts it uses go away.
+    if (background_pool_.get() != NULL) {
+      background_pool_->ShutDown();
+    }
+    if (beacon_pool_.get() != NULL) {
+      beacon_pool_->ShutDown();
+    }
     SystemRewriteDriverFactory::ShutDown();
   }
 }
@@ -216,6 +237,10 @@ void NgxRewriteDriverFactory::StartThreads() {
   bool ok = thread->Start();
   CHECK(ok) << "Unable to start scheduler thread";
   defer_cleanup(thread->MakeDeleter());
+  background_pool_.reset(
+      new QueuedWorkerPool(1, "ngx_background", thread_system()));
+  beacon_pool_.reset(
+      new QueuedWorkerPool(1, "ngx_beacons", thread_system()));
   threads_started_ = true;
 }
 
@@ -267,6 +292,8 @@ void NgxRewriteDriverFactory::InitStats(Statistics* statistics) {
   // Init Ngx-specific stats.
   NgxServerContext::InitStats(statistics);
   InPlaceResourceRecorder::InitStats(statistics);
+  NgxOutputCompressor::InitStats(statistics);
+  NgxRequestTiming::InitStats(statistics);
 }
 
 void NgxRewriteDriverFactory::PrepareForkedProcess(const char* name) {
@@ -41,10 +41,12 @@ extern "C" {
 
 namespace net_instaweb {
 
+class NgxFetchOrigins;
 class NgxMessageHandler;
 class NgxRewriteOptions;
 class NgxServerContext;
 class NgxUrlAsyncFetcher;
+class QueuedWorkerPool;
 class SharedCircularBuffer;
 class SharedMemRefererStatistics;
 class SlowWorker;
@@ -91,6 +93,14 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   // called after the caller has finished any forking it intends to do.
   void StartThreads();
 
+  // A single-threaded pool for work that shouldn't block the nginx thread,
+  // like refreshing remote configuration.  NULL until StartThreads().
+  QueuedWorkerPool* background_pool() { return background_pool_.get(); }
+  // A single-threaded pool for applying beacons.  It's kept apart from the
+  // background pool so a slow remote configuration fetch can't hold up
+  // beacons.  NULL until StartThreads().
+  QueuedWorkerPool* beacon_pool() { return beacon_pool_.get(); }
+
   void SetServerContextMessageHandler(ServerContext* server_context,
                                       ngx_log_t* log);
 
@@ -121,6 +131,10 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   void set_native_fetcher_max_keepalive_requests(int x) {
     native_fetcher_max_keepalive_requests_ = x;
   }
+  // Handles "NativeFetcherOrigin domain target [balancing]".  On failure
+  // returns false and sets *error.
+  bool AddNativeFetcherOrigin(StringPiece domain, StringPiece target,
+                              StringPiece balancing, GoogleString* error);
   ProcessScriptVariablesMode process_script_variables() {
     return process_script_variables_mode_;
   }
@@ -148,6 +162,8 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   Timer* timer_;
 
   bool threads_started_;
+  scoped_ptr<QueuedWorkerPool> background_pool_;
+  scoped_ptr<QueuedWorkerPool> beacon_pool_;
   NgxMessageHandler* ngx_message_handler_;
   NgxMessageHandler* ngx_html_parse_message_handler_;
 
@@ -157,6 +173,8 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   ngx_resolver_t* resolver_;
   bool use_native_fetcher_;
   int native_fetcher_max_keepalive_requests_;
+  // Shared by all native fetchers; NULL until an origin is configured.
+  scoped_ptr<NgxFetchOrigins> native_fetcher_origins_;
 
   typedef std::set<NgxMessageHandler*> NgxMessageHandlerSet;
   NgxMessageHandlerSet server_context_message_handlers_;
@@ -47,6 +47,11 @@ const char kConsolePath[] = "ConsolePath";
 const char kMessagesPath[] = "MessagesPath";
 const char kAdminPath[] = "AdminPath";
 const char kGlobalAdminPath[] = "GlobalAdminPath";
+const char kHtmlCompressionLevel[] = "HtmlCompressionLevel";
+const char kHtmlCompressionWindowBits[] = "HtmlCompressionWindowBits";
+const char kInPlaceNegativeLookupTtlMs[] = "InPlaceNegativeLookupTtlMs";
+const char kBeaconRateLimitMs[] = "BeaconRateLimitMs";
+const char kRequestPhaseTiming[] = "RequestPhaseTiming";
 
 // These options are copied from mod_instaweb.cc, where APACHE_CONFIG_OPTIONX
 // indicates that they can not be set at the directory/location level. They set
@@ -76,13 +81,15 @@ const char* const server_only_options[] = {
   "LoadFromFileRule",
   "LoadFromFileRuleMatch",
   "UseNativeFetcher",
-  "NativeFetcherMaxKeepaliveRequests"
+  "NativeFetcherMaxKeepaliveRequests",
+  "NativeFetcherOrigin"
 };
 
 // Options that can only be used in the main (http) option scope.
 const char* const main_only_options[] = {
   "UseNativeFetcher",
-  "NativeFetcherMaxKeepaliveRequests"
+  "NativeFetcherMaxKeepaliveRequests",
+  "NativeFetcherOrigin"
 };
 
 }  // namespace
@@ -133,6 +140,32 @@ void NgxRewriteOptions::AddProperties() {
       kProcessScopeStrict,
       "Set the global admin path.  Ex: /pagespeed_global_admin",
       false);
+  add_ngx_option(
+      0, &NgxRewriteOptions::html_compression_level_, "nhcl",
+      kHtmlCompressionLevel, kDirectoryScope,
+      "Gzip level (1-9) for rewritten html sent to clients that accept gzip, "
+      "instead of leaving it to nginx's gzip filter.  0 disables.", true);
+  add_ngx_option(
+      15, &NgxRewriteOptions::html_compression_window_bits_, "nhcw",
+      kHtmlCompressionWindowBits, kDirectoryScope,
+      "Window size, as a power of two (9-15), for HtmlCompressionLevel.",
+      true);
+  add_ngx_option(
+      0, &NgxRewriteOptions::in_place_negative_lookup_ttl_ms_, "nipn",
+      kInPlaceNegativeLookupTtlMs, kDirectoryScope,
+      "How long to skip the in-place cache lookup for a URL after a lookup "
+      "found it can't be rewritten.  0 disables.", true);
+  add_ngx_option(
+      0, &NgxRewriteOptions::beacon_rate_limit_ms_, "nbrl",
+      kBeaconRateLimitMs, kServerScope,
+      "Accept at most one beacon of each kind per page URL in this many "
+      "milliseconds, across all workers, and answer the rest without "
+      "handling them.  0 disables.", true);
+  add_ngx_option(
+      false, &NgxRewriteOptions::request_phase_timing_, "nrpt",
+      kRequestPhaseTiming, kServerScope,
+      "Time each phase of our work on a request, for the statistics "
+      "histograms and the $pagespeed_timing variable.", true);
 
   MergeSubclassProperties(ngx_properties_);
 
@@ -355,7 +388,7 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
               pool, directive, "Failed to compile script variables");
         } else {
           if (script_line == NULL) {
-            script_line = new ScriptLine(args, n_args, scope);
+            script_line = new ScriptLine(args, n_args, scope, directive);
           }
           script_line->AddScriptAndArgIndex(sc, i);
         }
@@ -372,6 +405,14 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
     }
   }
 
+  return SetOptionFromArgs(directive, args, n_args, pool, handler,
+                           driver_factory, scope);
+}
+
+const char* NgxRewriteOptions::SetOptionFromArgs(
+    StringPiece directive, StringPiece* args, int n_args, ngx_pool_t* pool,
+    MessageHandler* handler, NgxRewriteDriverFactory* driver_factory,
+    RewriteOptions::OptionScope scope) {
   GoogleString msg;
   OptionSettingResult result;
   if (n_args == 1) {
@@ -426,6 +467,10 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
             handler);
       }
     }
+  } else if (n_args == 3 && IsDirective(directive, "NativeFetcherOrigin")) {
+    result = driver_factory->AddNativeFetcherOrigin(
+        args[1], args[2], StringPiece(), &msg) ?
+        RewriteOptions::kOptionOk : RewriteOptions::kOptionValueInvalid;
   } else if (n_args == 3) {
     result = ParseAndSetOptionFromName2(directive, args[1], args[2],
                                         &msg, handler);
@@ -438,6 +483,10 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
           &msg,
           handler);
     }
+  } else if (n_args == 4 && IsDirective(directive, "NativeFetcherOrigin")) {
+    result = driver_factory->AddNativeFetcherOrigin(
+        args[1], args[2], args[3], &msg) ?
+        RewriteOptions::kOptionOk : RewriteOptions::kOptionValueInvalid;
   } else if (n_args == 4) {
     result = ParseAndSetOptionFromName3(
         directive, args[1], args[2], args[3], &msg, handler);
@@ -469,51 +518,79 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
 bool NgxRewriteOptions::ExecuteScriptVariables(
     ngx_http_request_t* r, MessageHandler* handler,
     NgxRewriteDriverFactory* driver_factory) {
-  bool script_error = false;
-
-  if (script_lines_.size() > 0) {
-    std::vector<RefCountedPtr<ScriptLine> >::iterator it;
-    for (it = script_lines_.begin() ; it != script_lines_.end(); ++it) {
-      ScriptLine* script_line = it->get();
-      StringPiece args[NGX_PAGESPEED_MAX_ARGS];
-      std::vector<ScriptArgIndex*>::iterator cs_it;
-      int i;
+  StringPieceVector values;
+  if (!EvaluateScriptVariables(r, handler, &values)) {
+    handler->Message(kWarning,
+        "Script error(s) in configuration, disabling optimization");
+    set_enabled(RewriteOptions::kEnabledOff);
+    return false;
+  }
+  return ApplyScriptVariables(values, r->pool, handler, driver_factory);
+}
 
-      for (i = 0; i < script_line->n_args(); i++) {
-        args[i] = script_line->args()[i];
+bool NgxRewriteOptions::EvaluateScriptVariables(
+    ngx_http_request_t* r, MessageHandler* handler,
+    StringPieceVector* values) const {
+  std::vector<RefCountedPtr<ScriptLine> >::const_iterator it;
+  for (it = script_lines_.begin() ; it != script_lines_.end(); ++it) {
+    ScriptLine* script_line = it->get();
+    std::vector<ScriptArgIndex*>::iterator cs_it;
+    for (cs_it = script_line->data().begin();
+         cs_it != script_line->data().end(); cs_it++) {
+      ngx_http_script_compile_t* script;
+      ngx_array_t* values_array;
+      ngx_array_t* lengths;
+      ngx_str_t value;
+
+      script = (*cs_it)->script();
+      lengths = *script->lengths;
+      values_array = *script->values;
+
+      if (ngx_http_script_run(r, &value, lengths->elts, 0, values_array->elts)
+          == NULL) {
+        handler->Message(kError, "ngx_http_script_run error");
+        return false;
       }
+      values->push_back(str_to_string_piece(value));
+    }
+  }
+  return true;
+}
 
-      for (cs_it = script_line->data().begin();
-           cs_it != script_line->data().end(); cs_it++) {
-        ngx_http_script_compile_t* script;
-        ngx_array_t* values;
-        ngx_array_t* lengths;
-        ngx_str_t value;
-
-        script = (*cs_it)->script();
-        lengths = *script->lengths;
-        values = *script->values;
-
-        if (ngx_http_script_run(r, &value, lengths->elts, 0, values->elts)
-            == NULL) {
-          handler->Message(kError, "ngx_http_script_run error");
-          script_error = true;
-          break;
-        } else  {
-          args[(*cs_it)->index()] = str_to_string_piece(value);
-        }
-      }
+bool NgxRewriteOptions::ApplyScriptVariables(
+    const StringPieceVector& values, ngx_pool_t* pool,
+    MessageHandler* handler, NgxRewriteDriverFactory* driver_factory) {
+  bool script_error = false;
+  int next_value = 0;
 
-      const char* status = ParseAndSetOptions(args, script_line->n_args(),
-          r->pool, handler, driver_factory, script_line->scope(), NULL /*cf*/,
-          ProcessScriptVariablesMode::kOff);
+  std::vector<RefCountedPtr<ScriptLine> >::iterator it;
+  for (it = script_lines_.begin() ; it != script_lines_.end(); ++it) {
+    ScriptLine* script_line = it->get();
+    StringPiece args[NGX_PAGESPEED_MAX_ARGS];
+    std::vector<ScriptArgIndex*>::iterator cs_it;
+    int i;
 
-      if (status != NULL) {
-        script_error = true;
-        handler->Message(kWarning,
-            "Error setting option value from script: '%s'", status);
-        break;
-      }
+    for (i = 0; i < script_line->n_args(); i++) {
+      args[i] = script_line->args()[i];
+    }
+
+    for (cs_it = script_line->data().begin();
+         cs_it != script_line->data().end(); cs_it++) {
+      CHECK_LT(next_value, static_cast<int>(values.size()));
+      args[(*cs_it)->index()] = values[next_value++];
+    }
+
+    // The directive was looked up and checked against its scope when the
+    // configuration was parsed, so go straight to setting the option.
+    const char* status = SetOptionFromArgs(
+        script_line->directive(), args, script_line->n_args(), pool, handler,
+        driver_factory, script_line->scope());
+
+    if (status != NULL) {
+      script_error = true;
+      handler->Message(kWarning,
+          "Error setting option value from script: '%s'", status);
+      break;
     }
   }
 
@@ -69,10 +69,12 @@ class ScriptArgIndex {
 // different rewriteoptions.
 class ScriptLine : public RefCounted<ScriptLine> {
  public:
+  // directive is args[0] without any "ModPagespeed" prefix.
   explicit ScriptLine(StringPiece* args, int n_args,
-                      RewriteOptions::OptionScope scope)
+                      RewriteOptions::OptionScope scope, StringPiece directive)
     : n_args_(n_args),
-      scope_(scope) {
+      scope_(scope),
+      directive_(directive) {
 
       for (int i = 0; i < n_args; i++) {
         args_[i] = args[i];
@@ -94,6 +96,7 @@ class ScriptLine : public RefCounted<ScriptLine> {
   int n_args() { return n_args_;}
   StringPiece* args() { return args_;}
   RewriteOptions::OptionScope scope() { return scope_; }
+  StringPiece directive() { return directive_; }
   std::vector<ScriptArgIndex*>& data() {
     return data_;
   }
@@ -102,6 +105,7 @@ class ScriptLine : public RefCounted<ScriptLine> {
   StringPiece args_[NGX_PAGESPEED_MAX_ARGS];
   int n_args_;
   RewriteOptions::OptionScope scope_;
+  StringPiece directive_;
   std::vector<ScriptArgIndex*> data_;
 
   DISALLOW_COPY_AND_ASSIGN(ScriptLine);
@@ -140,6 +144,17 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   bool ExecuteScriptVariables(
       ngx_http_request_t* r, MessageHandler* handler,
       NgxRewriteDriverFactory* driver_factory);
+  // The two halves of ExecuteScriptVariables().  EvaluateScriptVariables
+  // appends the value of each script argument, in order, to values; the
+  // values live in r->pool.  ApplyScriptVariables then sets options from
+  // those values.  Requests that evaluate to the same values get the same
+  // options, which lets callers cache the result.
+  bool EvaluateScriptVariables(
+      ngx_http_request_t* r, MessageHandler* handler,
+      StringPieceVector* values) const;
+  bool ApplyScriptVariables(
+      const StringPieceVector& values, ngx_pool_t* pool,
+      MessageHandler* handler, NgxRewriteDriverFactory* driver_factory);
   void CopyScriptLinesTo(NgxRewriteOptions* destination) const;
   void AppendScriptLinesTo(NgxRewriteOptions* destination) const;
 
@@ -169,6 +184,21 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   const GoogleString& global_admin_path() const {
     return global_admin_path_.value();
   }
+  int html_compression_level() const {
+    return html_compression_level_.value();
+  }
+  int html_compression_window_bits() const {
+    return html_compression_window_bits_.value();
+  }
+  int64 in_place_negative_lookup_ttl_ms() const {
+    return in_place_negative_lookup_ttl_ms_.value();
+  }
+  int64 beacon_rate_limit_ms() const {
+    return beacon_rate_limit_ms_.value();
+  }
+  bool request_phase_timing() const {
+    return request_phase_timing_.value();
+  }
   const std::vector<RefCountedPtr<ScriptLine> >& script_lines() const {
     return script_lines_;
   }
@@ -194,6 +224,14 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   OptionSettingResult ParseAndSetOptions0(
       StringPiece directive, GoogleString* msg, MessageHandler* handler);
 
+  // The part of ParseAndSetOptions() that sets the option, once directive has
+  // been checked against scope.  Script lines are applied with this directly,
+  // since their directives were checked when the configuration was parsed.
+  const char* SetOptionFromArgs(
+      StringPiece directive, StringPiece* args, int n_args, ngx_pool_t* pool,
+      MessageHandler* handler, NgxRewriteDriverFactory* driver_factory,
+      OptionScope scope);
+
   virtual OptionSettingResult ParseAndSetOptionFromName1(
       StringPiece name, StringPiece arg,
       GoogleString* msg, MessageHandler* handler);
@@ -230,6 +268,11 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   Option<GoogleString> messages_path_;
   Option<GoogleString> admin_path_;
   Option<GoogleString> global_admin_path_;
+  Option<int> html_compression_level_;
+  Option<int> html_compression_window_bits_;
+  Option<int64> in_place_negative_lookup_ttl_ms_;
+  Option<int64> beacon_rate_limit_ms_;
+  Option<bool> request_phase_timing_;
 
   bool clear_inherited_scripts_;
   std::vector<RefCountedPtr<ScriptLine> > script_lines_;
@@ -30,20 +30,73 @@ extern "C" {
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string_writer.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/util/gzip_inflater.h"
 #include "pagespeed/system/add_headers_fetcher.h"
 #include "pagespeed/system/loopback_route_fetcher.h"
 #include "pagespeed/system/system_request_context.h"
 
 namespace net_instaweb {
 
+namespace {
+
+// Resolved options are cheap to rebuild, so rather than track which entries
+// are in use we start over whenever the cache fills up.
+const size_t kMaxResolvedOptions = 1000;
+
+// Each pool keeps its idle drivers, and a pool can't be freed while any of its
+// drivers might be running, so we make a limited number of them.  A cache
+// flush replaces them all.
+const size_t kMaxSharedOptionsDriverPools = 100;
+
+// How often workers refetch remote configuration.  The fetch itself goes
+// through the HTTP cache, so most refreshes don't reach the remote server.
+const ngx_msec_t kRemoteOptionsRefreshMs = 5 * Timer::kSecondMs;
+
+// How many beacons a worker holds for the background pool before it starts
+// dropping them.  Beacons only tune future rewrites, so losing some under
+// load costs little.
+const size_t kMaxQueuedBeacons = 1000;
+
+const char kBeaconsQueued[] = "beacons_queued";
+const char kBeaconsDropped[] = "beacons_dropped";
+const char kBeaconsApplied[] = "beacons_applied";
+
+}  // namespace
+
 NgxServerContext::NgxServerContext(
     NgxRewriteDriverFactory* factory, StringPiece hostname, int port)
     : SystemServerContext(factory, hostname, port),
-      ngx_http2_variable_index_(NGX_ERROR) {
+      ngx_factory_(factory),
+      ngx_http2_variable_index_(NGX_ERROR),
+      last_cache_flush_poll_ms_(ngx_current_msec),
+      cache_flush_generation_(0),
+      driver_pools_made_(0),
+      remote_options_mutex_(factory->thread_system()->NewMutex()),
+      remote_refresh_pending_(false),
+      remote_refresh_started_ms_(0),
+      remote_options_sequence_(NULL),
+      beacon_mutex_(factory->thread_system()->NewMutex()),
+      beacon_batch_pending_(false),
+      beacon_sequence_(NULL),
+      beacons_queued_(NULL),
+      beacons_dropped_(NULL),
+      beacons_applied_(NULL) {
 }
 
 NgxServerContext::~NgxServerContext() { }
 
+void NgxServerContext::InitStats(Statistics* statistics) {
+  SystemServerContext::InitStats(statistics);
+  statistics->AddVariable(kBeaconsQueued);
+  statistics->AddVariable(kBeaconsDropped);
+  statistics->AddVariable(kBeaconsApplied);
+}
+
 NgxRewriteOptions* NgxServerContext::config() {
   return NgxRewriteOptions::DynamicCast(global_options());
 }
@@ -93,6 +146,203 @@ SystemRequestContext* NgxServerContext::NewRequestContext(
   return ctx;
 }
 
+bool NgxServerContext::GetGzippedStaticAsset(StringPiece file_name,
+                                             StringPiece contents,
+                                             StringPiece* gzipped) {
+  GoogleString key = file_name.as_string();
+  GzippedStaticAssetMap::iterator it = gzipped_static_assets_.find(key);
+  if (it == gzipped_static_assets_.end()) {
+    GoogleString compressed;
+    StringWriter writer(&compressed);
+    if (!GzipInflater::Deflate(contents, GzipInflater::kGzip, &writer) ||
+        compressed.size() >= contents.size()) {
+      compressed.clear();
+    }
+    it = gzipped_static_assets_.insert(
+        GzippedStaticAssetMap::value_type(key, compressed)).first;
+  }
+  if (it->second.empty()) {
+    return false;
+  }
+  *gzipped = it->second;
+  return true;
+}
+
+void NgxServerContext::PollCacheFlush() {
+  int64 interval_ms =
+      config()->cache_flush_poll_interval_sec() * Timer::kSecondMs;
+  if (interval_ms <= 0 ||
+      static_cast<int64>(ngx_current_msec - last_cache_flush_poll_ms_) <
+      interval_ms) {
+    return;
+  }
+  last_cache_flush_poll_ms_ = ngx_current_msec;
+  int64 invalidation_ms = global_options()->cache_invalidation_timestamp();
+  FlushCacheIfNecessary();
+  // Resolved options were cloned from global options that a flush changes,
+  // so a flush makes them stale.  Polls that find nothing leave them be.
+  if (global_options()->cache_invalidation_timestamp() != invalidation_ms) {
+    ++cache_flush_generation_;
+  }
+}
+
+NgxSharedOptionsPtr NgxServerContext::LookupResolvedOptions(
+    const GoogleString& key) {
+  ResolvedOptionsMap::iterator it = resolved_options_.find(key);
+  if (it == resolved_options_.end()) {
+    // Options with a pool are still current if the pool is, and reusing them
+    // keeps their drivers in use.
+    DriverPoolMap::iterator pool_it = driver_pools_.find(key);
+    if (pool_it != driver_pools_.end() &&
+        pool_it->second.generation == cache_flush_generation_) {
+      NgxSharedOptionsPtr options = pool_it->second.pool->options();
+      InsertResolvedOptions(key, options);
+      return options;
+    }
+    return NgxSharedOptionsPtr();
+  }
+  if (it->second.generation != cache_flush_generation_) {
+    resolved_options_.erase(it);
+    return NgxSharedOptionsPtr();
+  }
+  return it->second.options;
+}
+
+void NgxServerContext::InsertResolvedOptions(
+    const GoogleString& key, const NgxSharedOptionsPtr& options) {
+  if (resolved_options_.size() >= kMaxResolvedOptions) {
+    resolved_options_.clear();
+  }
+  ResolvedOptions& entry = resolved_options_[key];
+  entry.options = options;
+  entry.generation = cache_flush_generation_;
+}
+
+RewriteDriverPool* NgxServerContext::SharedOptionsDriverPool(
+    const NgxSharedOptionsPtr& options) {
+  const GoogleString& key = options->key();
+  if (key.empty()) {
+    return NULL;
+  }
+  DriverPoolMap::iterator it = driver_pools_.find(key);
+  if (it != driver_pools_.end() &&
+      it->second.pool->options().get() == options.get()) {
+    return it->second.pool;
+  }
+  if (driver_pools_made_ >= kMaxSharedOptionsDriverPools) {
+    return NULL;
+  }
+
+  ++driver_pools_made_;
+  PooledOptions& entry = driver_pools_[key];
+  entry.pool = new NgxSharedOptionsDriverPool(options);
+  entry.generation = cache_flush_generation_;
+  ManageRewriteDriverPool(entry.pool);
+  return entry.pool;
+}
+
+NgxSharedOptionsPtr NgxServerContext::LatestRemoteOptions() {
+  NgxSharedOptionsPtr snapshot;
+  bool start_refresh = false;
+  {
+    ScopedMutex lock(remote_options_mutex_.get());
+    snapshot = remote_options_;
+    if (!remote_refresh_pending_ &&
+        (snapshot.get() == NULL ||
+         ngx_current_msec - remote_refresh_started_ms_ >=
+         kRemoteOptionsRefreshMs)) {
+      remote_refresh_pending_ = true;
+      start_refresh = true;
+    }
+  }
+
+  if (start_refresh) {
+    QueuedWorkerPool* pool = ngx_factory_->background_pool();
+    if (pool == NULL) {
+      ScopedMutex lock(remote_options_mutex_.get());
+      remote_refresh_pending_ = false;
+    } else {
+      if (remote_options_sequence_ == NULL) {
+        remote_options_sequence_ = pool->NewSequence();
+      }
+      remote_refresh_started_ms_ = ngx_current_msec;
+      remote_options_sequence_->Add(
+          MakeFunction(this, &NgxServerContext::RefreshRemoteOptions));
+    }
+  }
+  return snapshot;
+}
+
+void NgxServerContext::RefreshRemoteOptions() {
+  RewriteOptions* options = global_options()->Clone();
+  // This fetch blocks for up to remote_configuration_timeout_ms, but only
+  // this background thread waits on it.
+  GetRemoteOptions(options, false);
+  NgxSharedOptionsPtr snapshot(new NgxSharedOptions(options, ""));
+
+  ScopedMutex lock(remote_options_mutex_.get());
+  remote_options_ = snapshot;
+  remote_refresh_pending_ = false;
+}
+
+bool NgxServerContext::QueueBeacon(StringPiece beacon_data,
+                                   StringPiece user_agent,
+                                   const RequestContextPtr& request_context) {
+  QueuedWorkerPool* pool = ngx_factory_->beacon_pool();
+  if (pool == NULL) {
+    HandleBeacon(beacon_data, user_agent, request_context);
+    return true;
+  }
+
+  if (beacon_sequence_ == NULL) {
+    beacon_sequence_ = pool->NewSequence();
+    beacons_queued_ = statistics()->GetVariable(kBeaconsQueued);
+    beacons_dropped_ = statistics()->GetVariable(kBeaconsDropped);
+    beacons_applied_ = statistics()->GetVariable(kBeaconsApplied);
+  }
+
+  bool start_batch = false;
+  {
+    ScopedMutex lock(beacon_mutex_.get());
+    if (queued_beacons_.size() >= kMaxQueuedBeacons) {
+      beacons_dropped_->Add(1);
+      return false;
+    }
+    queued_beacons_.push_back(QueuedBeacon());
+    QueuedBeacon& beacon = queued_beacons_.back();
+    beacon_data.CopyToString(&beacon.data);
+    user_agent.CopyToString(&beacon.user_agent);
+    beacon.request_context = request_context;
+    if (!beacon_batch_pending_) {
+      beacon_batch_pending_ = true;
+      start_batch = true;
+    }
+  }
+  beacons_queued_->Add(1);
+
+  // Beacons that arrive while a batch is waiting to run join it.
+  if (start_batch) {
+    beacon_sequence_->Add(
+        MakeFunction(this, &NgxServerContext::ApplyQueuedBeacons));
+  }
+  return true;
+}
+
+void NgxServerContext::ApplyQueuedBeacons() {
+  BeaconQueue batch;
+  {
+    ScopedMutex lock(beacon_mutex_.get());
+    batch.swap(queued_beacons_);
+    beacon_batch_pending_ = false;
+  }
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const QueuedBeacon& beacon = batch[i];
+    HandleBeacon(beacon.data, beacon.user_agent, beacon.request_context);
+  }
+  beacons_applied_->Add(batch.size());
+}
+
 GoogleString NgxServerContext::FormatOption(StringPiece option_name,
                                             StringPiece args) {
   return StrCat("pagespeed ", option_name, " ", args, ";");
@@ -24,7 +24,19 @@
 #ifndef NGX_SERVER_CONTEXT_H_
 #define NGX_SERVER_CONTEXT_H_
 
+#include <map>
+#include <vector>
+
 #include "ngx_message_handler.h"
+#include "ngx_path_router.h"
+#include "net/instaweb/http/public/request_context.h"
+#include "net/instaweb/rewriter/public/rewrite_driver_pool.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "pagespeed/kernel/base/ref_counted_ptr.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
 #include "pagespeed/system/system_server_context.h"
 
 extern "C" {
@@ -33,9 +45,61 @@ extern "C" {
 
 namespace net_instaweb {
 
+class AbstractMutex;
 class NgxRewriteDriverFactory;
 class NgxRewriteOptions;
+class RewriteDriver;
+class Statistics;
 class SystemRequestContext;
+class Variable;
+
+// Options resolved for one configuration (server or location block) and one
+// set of script variable values, shared by all the requests that resolve to
+// them.  They must not be modified once shared.  Rewrite drivers use them
+// through an NgxSharedOptionsDriverPool; anything else that takes ownership of
+// its options, like a ResourceFetch, gets a Clone().
+class NgxSharedOptions : public RefCounted<NgxSharedOptions> {
+ public:
+  // key identifies what the options were resolved from.  It's empty for
+  // options that don't come from NgxServerContext::InsertResolvedOptions.
+  NgxSharedOptions(RewriteOptions* options, const GoogleString& key)
+      : options_(options), key_(key) {}
+
+  RewriteOptions* options() const { return options_.get(); }
+  const GoogleString& key() const { return key_; }
+
+ private:
+  friend class RefCounted<NgxSharedOptions>;
+  ~NgxSharedOptions() {}
+
+  scoped_ptr<RewriteOptions> options_;
+  const GoogleString key_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedOptions);
+};
+
+typedef RefCountedPtr<NgxSharedOptions> NgxSharedOptionsPtr;
+
+// Rewrite drivers that all use one set of shared options without owning them,
+// the way the standard pool's drivers use the global options.  The pool holds
+// a reference to the options, and the server context owns the pool until it
+// shuts down, so the options outlive every driver that uses them.
+class NgxSharedOptionsDriverPool : public RewriteDriverPool {
+ public:
+  explicit NgxSharedOptionsDriverPool(const NgxSharedOptionsPtr& options)
+      : options_(options) {}
+  virtual ~NgxSharedOptionsDriverPool() {}
+
+  virtual const RewriteOptions* TargetOptions() const {
+    return options_->options();
+  }
+  const NgxSharedOptionsPtr& options() const { return options_; }
+
+ private:
+  NgxSharedOptionsPtr options_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedOptionsDriverPool);
+};
 
 class NgxServerContext : public SystemServerContext {
  public:
@@ -43,6 +107,8 @@ class NgxServerContext : public SystemServerContext {
       NgxRewriteDriverFactory* factory, StringPiece hostname, int port);
   virtual ~NgxServerContext();
 
+  static void InitStats(Statistics* statistics);
+
   // We don't allow ProxyFetch to fetch HTML via MapProxyDomain. We will call
   // set_trusted_input() on any ProxyFetches we use to transform internal HTML.
   virtual bool ProxiesHtml() const { return false; }
@@ -69,10 +135,118 @@ class NgxServerContext : public SystemServerContext {
     return ngx_http2_variable_index_;
   }
 
+  // Looks up the gzipped version of the static asset file_name, whose
+  // uncompressed body is contents.  Each asset is compressed the first time
+  // it is asked for and kept for the lifetime of the server context.  Returns
+  // false if gzip doesn't make the asset smaller.  Only call this from the
+  // nginx thread.
+  bool GetGzippedStaticAsset(StringPiece file_name, StringPiece contents,
+                             StringPiece* gzipped);
+
+  // Paths this server block handles itself; filled in at configuration time.
+  NgxPathRouter* path_router() { return &path_router_; }
+
+  // Polls for a cache flush if this server's cache flush poll interval has
+  // passed since the last poll.  Called from a per-worker timer, so requests
+  // never poll themselves.  Only call this from the nginx thread.
+  void PollCacheFlush();
+
+  // A per-worker cache of resolved options, keyed by what they were resolved
+  // from.  Entries are dropped once a cache flush poll finds a flush, so
+  // requests using them see a cache flush no later than requests resolving
+  // their options from scratch.  Lookups return NULL on a miss.  Only call these
+  // from the nginx thread.
+  NgxSharedOptionsPtr LookupResolvedOptions(const GoogleString& key);
+  void InsertResolvedOptions(const GoogleString& key,
+                             const NgxSharedOptionsPtr& options);
+
+  // Returns the driver pool for resolved options, creating it if need be, so
+  // requests can get rewrite drivers that use them without a Clone().
+  // Returns NULL for options that weren't resolved by key, like remote
+  // configuration snapshots, and once the worker has made
+  // kMaxSharedOptionsDriverPools pools; requests then clone their options as
+  // before.  Pools are kept until shutdown, since drivers from them may still
+  // be running.  Only call this from the nginx thread.
+  RewriteDriverPool* SharedOptionsDriverPool(
+      const NgxSharedOptionsPtr& options);
+
+  // Remote configuration is fetched on the factory's background pool and
+  // published as a snapshot: the global options with the remote options
+  // merged in.  Returns the latest snapshot, or NULL if none has been fetched
+  // yet, and starts a new fetch if the snapshot is due for a refresh.  Never
+  // waits for the remote configuration server.  Only call this from the nginx
+  // thread, after the factory has started its threads.
+  NgxSharedOptionsPtr LatestRemoteOptions();
+
+  // Queues a beacon to be passed to HandleBeacon on the factory's beacon
+  // pool, in batches, so the property cache work it does stays off the nginx
+  // thread.  If too many beacons are already waiting the beacon is dropped
+  // and this returns false.  Only call this from the nginx thread.
+  bool QueueBeacon(StringPiece beacon_data, StringPiece user_agent,
+                   const RequestContextPtr& request_context);
+
  private:
+  struct QueuedBeacon {
+    GoogleString data;
+    GoogleString user_agent;
+    RequestContextPtr request_context;
+  };
+  typedef std::vector<QueuedBeacon> BeaconQueue;
+
+  // Runs on remote_options_sequence_.
+  void RefreshRemoteOptions();
+  // Runs on beacon_sequence_.
+  void ApplyQueuedBeacons();
+
+  typedef std::map<GoogleString, GoogleString> GzippedStaticAssetMap;
+
+  struct ResolvedOptions {
+    NgxSharedOptionsPtr options;
+    // cache_flush_generation_ when the options were resolved.
+    uint64 generation;
+  };
+  typedef std::map<GoogleString, ResolvedOptions> ResolvedOptionsMap;
+
+  struct PooledOptions {
+    NgxSharedOptionsDriverPool* pool;  // Owned by the ServerContext.
+    // cache_flush_generation_ when the pool was made.
+    uint64 generation;
+  };
+  typedef std::map<GoogleString, PooledOptions> DriverPoolMap;
+
   NgxRewriteDriverFactory* ngx_factory_;
   // what index the "http2" var is, or NGX_ERROR.
   ngx_int_t ngx_http2_variable_index_;
+  // Empty values mark assets that don't benefit from compression.
+  GzippedStaticAssetMap gzipped_static_assets_;
+  NgxPathRouter path_router_;
+  ResolvedOptionsMap resolved_options_;
+  // The latest pool for each key, which outlives its resolved_options_ entry.
+  DriverPoolMap driver_pools_;
+  // Every pool we've made, including ones driver_pools_ has since replaced.
+  size_t driver_pools_made_;
+  // Both only used on the nginx thread.  The generation counts cache flushes
+  // polling has found.
+  ngx_msec_t last_cache_flush_poll_ms_;
+  uint64 cache_flush_generation_;
+
+  scoped_ptr<AbstractMutex> remote_options_mutex_;
+  NgxSharedOptionsPtr remote_options_;  // Guarded by remote_options_mutex_.
+  bool remote_refresh_pending_;         // Guarded by remote_options_mutex_.
+  // When the last refresh was started; only used on the nginx thread.
+  ngx_msec_t remote_refresh_started_ms_;
+  // Owned by the factory's background pool.
+  QueuedWorkerPool::Sequence* remote_options_sequence_;
+
+  scoped_ptr<AbstractMutex> beacon_mutex_;
+  BeaconQueue queued_beacons_;  // Guarded by beacon_mutex_.
+  bool beacon_batch_pending_;   // Guarded by beacon_mutex_.
+  // Owned by the factory's beacon pool.
+  QueuedWorkerPool::Sequence* beacon_sequence_;
+  // Looked up the first time a beacon is queued.
+  Variable* beacons_queued_;
+  Variable* beacons_dropped_;
+  Variable* beacons_applied_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxServerContext);
 };
@@ -0,0 +1,173 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "ngx_shared_hash_table.h"
+
+#include "base/logging.h"
+
+namespace net_instaweb {
+
+NgxSharedHashTable::NgxSharedHashTable(ngx_uint_t num_slots)
+    : num_slots_(num_slots),
+      header_(NULL) {
+  ngx_memzero(&mutex_, sizeof(mutex_));
+}
+
+NgxSharedHashTable* NgxSharedHashTable::Create(ngx_conf_t* cf,
+                                               StringPiece name,
+                                               ngx_uint_t num_slots,
+                                               void* tag) {
+  CHECK(num_slots >= kMaxProbes);
+  ngx_str_t zone_name;
+  zone_name.len = name.size();
+  zone_name.data = static_cast<u_char*>(ngx_pnalloc(cf->pool, name.size()));
+  if (zone_name.data == NULL) {
+    return NULL;
+  }
+  ngx_memcpy(zone_name.data, name.data(), name.size());
+
+  size_t size = sizeof(Header) + num_slots * sizeof(Entry);
+  ngx_shm_zone_t* zone = ngx_shared_memory_add(cf, &zone_name, size, tag);
+  if (zone == NULL) {
+    return NULL;
+  }
+
+  ngx_pool_cleanup_t* cleanup = ngx_pool_cleanup_add(cf->pool, 0);
+  if (cleanup == NULL) {
+    return NULL;
+  }
+  NgxSharedHashTable* table = new NgxSharedHashTable(num_slots);
+  cleanup->handler = Cleanup;
+  cleanup->data = table;
+
+  // We lay out the zone ourselves rather than using nginx's slab allocator.
+  zone->noslab = 1;
+  zone->init = InitZone;
+  zone->data = table;
+  return table;
+}
+
+void NgxSharedHashTable::Cleanup(void* data) {
+  delete static_cast<NgxSharedHashTable*>(data);
+}
+
+// Called by nginx in the master process once the zone is mapped.  On a
+// reload with an unchanged zone, data is the previous configuration's table
+// and the entries it left are kept.
+ngx_int_t NgxSharedHashTable::InitZone(ngx_shm_zone_t* zone, void* data) {
+  NgxSharedHashTable* table = static_cast<NgxSharedHashTable*>(zone->data);
+  table->header_ = reinterpret_cast<Header*>(zone->shm.addr);
+
+  if (data == NULL && !zone->shm.exists) {
+    ngx_memzero(zone->shm.addr, zone->shm.size);
+  }
+
+  if (ngx_shmtx_create(&table->mutex_, &table->header_->lock, NULL)
+      != NGX_OK) {
+    return NGX_ERROR;
+  }
+  return NGX_OK;
+}
+
+// 64-bit FNV-1a.
+uint64 NgxSharedHashTable::HashKey(StringPiece s) {
+  uint64 hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < s.size(); ++i) {
+    hash ^= static_cast<unsigned char>(s[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool NgxSharedHashTable::Claim(uint64 key, int64 now_ms, int64 expires_ms) {
+  if (header_ == NULL) {
+    return true;
+  }
+
+  Entry* slots = entries();
+  ngx_uint_t start = key % num_slots_;
+  Entry* victim = NULL;
+  bool claimed = true;
+
+  ngx_shmtx_lock(&mutex_);
+  for (ngx_uint_t i = 0; i < kMaxProbes; ++i) {
+    Entry* entry = &slots[(start + i) % num_slots_];
+    bool live = entry->expires_ms > now_ms;
+    if (live && entry->key == key) {
+      claimed = false;
+      break;
+    }
+    // Keep looking for key, but note where we'd put it: the first free slot,
+    // or failing that the entry closest to expiring.
+    if (victim == NULL) {
+      victim = entry;
+    } else if (victim->expires_ms > now_ms &&
+               (!live || entry->expires_ms < victim->expires_ms)) {
+      victim = entry;
+    }
+  }
+  if (claimed) {
+    victim->key = key;
+    victim->expires_ms = expires_ms;
+  }
+  ngx_shmtx_unlock(&mutex_);
+  return claimed;
+}
+
+bool NgxSharedHashTable::Contains(uint64 key, int64 now_ms) {
+  if (header_ == NULL) {
+    return false;
+  }
+
+  Entry* slots = entries();
+  ngx_uint_t start = key % num_slots_;
+  bool found = false;
+
+  ngx_shmtx_lock(&mutex_);
+  for (ngx_uint_t i = 0; i < kMaxProbes; ++i) {
+    Entry* entry = &slots[(start + i) % num_slots_];
+    if (entry->key == key && entry->expires_ms > now_ms) {
+      found = true;
+      break;
+    }
+  }
+  ngx_shmtx_unlock(&mutex_);
+  return found;
+}
+
+void NgxSharedHashTable::Release(uint64 key, int64 expires_ms) {
+  if (header_ == NULL) {
+    return;
+  }
+
+  Entry* slots = entries();
+  ngx_uint_t start = key % num_slots_;
+
+  ngx_shmtx_lock(&mutex_);
+  for (ngx_uint_t i = 0; i < kMaxProbes; ++i) {
+    Entry* entry = &slots[(start + i) % num_slots_];
+    if (entry->key == key && entry->expires_ms == expires_ms) {
+      entry->expires_ms = 0;
+      break;
+    }
+  }
+  ngx_shmtx_unlock(&mutex_);
+}
+
+}  // namespace net_instaweb
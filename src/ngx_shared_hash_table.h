@@ -0,0 +1,95 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// A fixed-size hash table in an nginx shared memory zone, so that all workers
+// see the same entries.  Keys are 64-bit hashes and every entry carries an
+// expiry time, after which its slot is free again; a worker that dies holding
+// an entry can't leave it stuck.  The zone is registered while parsing the
+// configuration and keeps its contents across reloads.
+//
+// Each lookup looks at a short run of slots.  When the run is full, the entry
+// closest to expiring gives way, so a table that is too small degrades to
+// forgetting entries early rather than failing.
+
+#ifndef NGX_SHARED_HASH_TABLE_H_
+#define NGX_SHARED_HASH_TABLE_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class NgxSharedHashTable {
+ public:
+  // Registers a zone called name with room for num_slots entries, owned by
+  // the module identified by tag.  Returns NULL if nginx won't add the zone.
+  // The table is freed along with cf->pool.
+  static NgxSharedHashTable* Create(ngx_conf_t* cf, StringPiece name,
+                                    ngx_uint_t num_slots, void* tag);
+
+  static uint64 HashKey(StringPiece s);
+
+  // Adds key with the given expiry, unless it's already present and hasn't
+  // expired as of now_ms.  Returns whether key was added.
+  bool Claim(uint64 key, int64 now_ms, int64 expires_ms);
+
+  // Returns whether key is present and hasn't expired as of now_ms.
+  bool Contains(uint64 key, int64 now_ms);
+
+  // Removes key if it's present with the expiry it was claimed with.  An entry
+  // for key with any other expiry was claimed by someone else after ours
+  // expired, and is left alone.
+  void Release(uint64 key, int64 expires_ms);
+
+ private:
+  struct Entry {
+    uint64 key;
+    int64 expires_ms;  // 0 for a free slot.
+  };
+
+  // Lives at the start of the zone, followed by the entries.
+  struct Header {
+    ngx_shmtx_sh_t lock;
+  };
+
+  static const ngx_uint_t kMaxProbes = 8;
+
+  explicit NgxSharedHashTable(ngx_uint_t num_slots);
+
+  static ngx_int_t InitZone(ngx_shm_zone_t* zone, void* data);
+  static void Cleanup(void* data);
+
+  Entry* entries() { return reinterpret_cast<Entry*>(header_ + 1); }
+
+  ngx_uint_t num_slots_;
+  Header* header_;  // NULL until nginx has set up the zone.
+  ngx_shmtx_t mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedHashTable);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SHARED_HASH_TABLE_H_
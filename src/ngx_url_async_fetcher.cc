@@ -26,6 +26,7 @@ extern "C" {
 
 #include "ngx_url_async_fetcher.h"
 #include "ngx_fetch.h"
+#include "ngx_fetch_origins.h"
 
 #include <vector>
 #include <algorithm>
@@ -59,6 +60,7 @@ namespace net_instaweb {
                                          ngx_msec_t fetch_timeout,
                                          ngx_resolver_t* resolver,
                                          int max_keepalive_requests,
+                                         NgxFetchOrigins* origins,
                                          ThreadSystem* thread_system,
                                          MessageHandler* handler)
     : fetchers_count_(0),
@@ -69,6 +71,9 @@ namespace net_instaweb {
       message_handler_(handler),
       mutex_(NULL),
       max_keepalive_requests_(max_keepalive_requests),
+      origins_(origins),
+      timeout_head_(NULL),
+      timeout_tail_(NULL),
       event_connection_(NULL) {
     resolver_timeout_ = resolver_timeout;
     fetch_timeout_ = fetch_timeout;
@@ -81,6 +86,7 @@ namespace net_instaweb {
     log_ = log;
     pool_ = NULL;
     resolver_ = resolver;
+    ngx_memzero(&timeout_event_, sizeof(timeout_event_));
     // If init fails, set shutdown_ so no fetches will be attempted.
     if (!Init(const_cast<ngx_cycle_t*>(ngx_cycle))) {
       shutdown_ = true;
@@ -100,6 +106,10 @@ namespace net_instaweb {
     active_fetches_.DeleteAll();
     NgxConnection::Terminate();
 
+    if (timeout_event_.timer_set) {
+      ngx_del_timer(&timeout_event_);
+    }
+
     if (pool_ != NULL) {
       ngx_destroy_pool(pool_);
       pool_ = NULL;
@@ -156,6 +166,9 @@ namespace net_instaweb {
   // thread. It should be called in the worker process.
   bool NgxUrlAsyncFetcher::Init(ngx_cycle_t* cycle) {
     log_ = cycle->log;
+    timeout_event_.data = this;
+    timeout_event_.handler = NgxUrlAsyncFetcher::TimeoutHandler;
+    timeout_event_.log = log_;
     CHECK(event_connection_ == NULL) << "event connection already set";
     event_connection_ = new NgxEventConnection(ReadCallback);
     if (!event_connection_->Init(cycle)) {
@@ -170,6 +183,12 @@ namespace net_instaweb {
       }
     }
 
+    // Origins that fail to initialize are logged, and are fetched through
+    // the resolver as usual.
+    if (origins_ != NULL) {
+      origins_->Init(cycle, message_handler_);
+    }
+
     if (proxy_.url.len == 0) {
       return true;
     }
@@ -203,6 +222,9 @@ namespace net_instaweb {
       }
       active_fetches_.Clear();
     }
+    if (timeout_event_.timer_set) {
+      ngx_del_timer(&timeout_event_);
+    }
     if (event_connection_ != NULL) {
       event_connection_->Shutdown();
       delete event_connection_;
@@ -292,6 +314,68 @@ namespace net_instaweb {
     completed_fetches_.Add(fetch);
   }
 
+  void NgxUrlAsyncFetcher::AddFetchTimeout(NgxFetch* fetch) {
+    DCHECK(!fetch->timeout_linked_);
+    fetch->timeout_deadline_ms_ = ngx_current_msec + fetch_timeout_;
+    fetch->timeout_prev_ = timeout_tail_;
+    fetch->timeout_next_ = NULL;
+    fetch->timeout_linked_ = true;
+    if (timeout_tail_ != NULL) {
+      timeout_tail_->timeout_next_ = fetch;
+    } else {
+      timeout_head_ = fetch;
+    }
+    timeout_tail_ = fetch;
+
+    // A pending timer fires for an earlier deadline, and TimeoutHandler()
+    // re-arms it for the ones behind it.
+    if (!timeout_event_.timer_set) {
+      ngx_add_timer(&timeout_event_, fetch_timeout_);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::CancelFetchTimeout(NgxFetch* fetch) {
+    if (!fetch->timeout_linked_) {
+      return;
+    }
+    if (fetch->timeout_prev_ != NULL) {
+      fetch->timeout_prev_->timeout_next_ = fetch->timeout_next_;
+    } else {
+      timeout_head_ = fetch->timeout_next_;
+    }
+    if (fetch->timeout_next_ != NULL) {
+      fetch->timeout_next_->timeout_prev_ = fetch->timeout_prev_;
+    } else {
+      timeout_tail_ = fetch->timeout_prev_;
+    }
+    fetch->timeout_prev_ = NULL;
+    fetch->timeout_next_ = NULL;
+    fetch->timeout_linked_ = false;
+
+    // When the head goes away we leave the timer as is; an early wakeup
+    // just re-arms it for the new head.
+    if (timeout_head_ == NULL && timeout_event_.timer_set) {
+      ngx_del_timer(&timeout_event_);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::TimeoutHandler(ngx_event_t* tev) {
+    NgxUrlAsyncFetcher* fetcher = static_cast<NgxUrlAsyncFetcher*>(tev->data);
+    // CallbackDone() unlinks the fetch, so we keep looking at the head.
+    while (fetcher->timeout_head_ != NULL) {
+      NgxFetch* fetch = fetcher->timeout_head_;
+      ngx_msec_int_t left = static_cast<ngx_msec_int_t>(
+          fetch->timeout_deadline_ms_ - ngx_current_msec);
+      if (left > 0) {
+        ngx_add_timer(tev, static_cast<ngx_msec_t>(left));
+        return;
+      }
+      ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                    "NgxFetch %p: timed out", fetch);
+      fetch->CallbackDone(false);
+    }
+  }
+
   void NgxUrlAsyncFetcher::PrintActiveFetches(MessageHandler* handler) const {
     for (NgxFetchPool::const_iterator p = active_fetches_.begin(),
         e = active_fetches_.end(); p != e; ++p) {
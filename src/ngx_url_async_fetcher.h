@@ -52,6 +52,7 @@ class AsyncFetch;
 class MessageHandler;
 class Statistics;
 class NgxFetch;
+class NgxFetchOrigins;
 class Variable;
 
 class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
@@ -59,8 +60,8 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   NgxUrlAsyncFetcher(
       const char* proxy, ngx_log_t* log, ngx_msec_t resolver_timeout,
       ngx_msec_t fetch_timeout, ngx_resolver_t* resolver,
-      int max_keepalive_requests, ThreadSystem* thread_system,
-      MessageHandler* handler);
+      int max_keepalive_requests, NgxFetchOrigins* origins,
+      ThreadSystem* thread_system, MessageHandler* handler);
 
   ~NgxUrlAsyncFetcher();
 
@@ -118,8 +119,16 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   bool shutdown() const { return shutdown_; }
   void set_shutdown(bool s) { shutdown_ = s; }
 
+  // Fetch timeouts are tracked in a list ordered by deadline, which is
+  // served by a single timer instead of one nginx timer per fetch.  As all
+  // fetches share fetch_timeout_, appending keeps the list sorted.  Only
+  // called from the nginx thread.
+  void AddFetchTimeout(NgxFetch* fetch);
+  void CancelFetchTimeout(NgxFetch* fetch);
 
  private:
+  // Fails all fetches whose deadline has passed, and re-arms the timer for
+  // the next one.
   static void TimeoutHandler(ngx_event_t* tev);
   static bool ParseUrl(ngx_url_t* url, ngx_pool_t* pool);
   friend class NgxFetch;
@@ -144,9 +153,16 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   ngx_log_t* log_;
   ngx_resolver_t* resolver_;
   int max_keepalive_requests_;
+  // Origins that are fetched from local sockets or upstream{} blocks instead
+  // of resolving their host.  Owned by the driver factory, may be NULL.
+  NgxFetchOrigins* origins_;
   ngx_msec_t resolver_timeout_;
   ngx_msec_t fetch_timeout_;
 
+  ngx_event_t timeout_event_;
+  NgxFetch* timeout_head_;
+  NgxFetch* timeout_tail_;
+
   NgxEventConnection* event_connection_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxUrlAsyncFetcher);
@@ -1185,6 +1185,206 @@ check_from "$JS_HEADERS" fgrep -qi 'Vary: Accept-Encoding'
 check_from "$JS_HEADERS" egrep -qi 'Etag: W/"0"'
 check_from "$JS_HEADERS" fgrep -qi 'Last-Modified:'
 
+start_test JS served uncompressed without Accept-Encoding: gzip
+JS_HEADERS=$($WGET -O /dev/null -q -S $JS_URL 2>&1)
+check_200_http_response "$JS_HEADERS"
+check_not_from "$JS_HEADERS" fgrep -qi 'Content-Encoding: gzip'
+check_from "$JS_HEADERS" egrep -qi 'Etag: W/"0"'
+
+
+# Checks that the html at $1 is gzipped by us for clients that accept it, and
+# sent plain to others.
+check_html_compression() {
+  local url="$1"
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET -O - -q -S \
+        --header='Accept-Encoding: gzip' $url 2>&1)
+  check_from "$OUT" fgrep -qi 'Content-Encoding: gzip'
+  check_from "$OUT" fgrep -qi 'Vary: Accept-Encoding'
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET -O - -q \
+        --header='Accept-Encoding: gzip' $url | gunzip)
+  check_from "$OUT" fgrep -qi '</html>'
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $url)
+  check_not_from "$OUT" fgrep -qi 'Content-Encoding:'
+}
+
+start_test HtmlCompressionLevel gzips rewritten html itself
+check_html_compression \
+  "http://html-compression.example.com/mod_pagespeed_example/index.html"
+
+start_test HtmlCompressionLevel set in a location gzips rewritten html itself
+URL="http://html-compression-location.example.com/"
+URL+="mod_pagespeed_example/index.html"
+check_html_compression $URL
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test NativeFetcherOrigin fetches from a unix domain socket
+  URL="http://native-origin-unix-front.example.com/"
+  URL+="mod_pagespeed_example/combine_css.html"
+  http_proxy=$SECONDARY_HOSTNAME \
+    fetch_until $URL 'grep -c \.pagespeed\.cc\.' 1
+  ORIGIN_LOG="$TEST_TMP/native-origin-unix.access.log"
+  check fgrep -q "GET /mod_pagespeed_example/styles/yellow.css" $ORIGIN_LOG
+
+  start_test NativeFetcherOrigin fetches from an upstream block
+  URL="http://native-origin-upstream-front.example.com/"
+  URL+="mod_pagespeed_example/combine_css.html"
+  http_proxy=$SECONDARY_HOSTNAME \
+    fetch_until $URL 'grep -c \.pagespeed\.cc\.' 1
+  ORIGIN_LOG="$TEST_TMP/native-origin-upstream.access.log"
+  check fgrep -q "GET /mod_pagespeed_example/styles/yellow.css" $ORIGIN_LOG
+fi
+
+start_test NativeFetcherOrigin rejects bad targets and balancing modes
+# Writes a configuration using "pagespeed NativeFetcherOrigin $1" and checks
+# that nginx -t rejects it with message $2.
+check_bad_native_fetcher_origin() {
+  local bad_conf="$TEST_TMP/native-origin-bad.conf"
+  cat > "$bad_conf" <<EOF
+events {
+}
+http {
+  pagespeed NativeFetcherOrigin $1;
+}
+EOF
+  OUT=$($NGINX_EXECUTABLE -t -c "$bad_conf" 2>&1) || true
+  check_from "$OUT" fgrep -q "$2"
+  check_from "$OUT" fgrep -q "test failed"
+}
+check_bad_native_fetcher_origin "bad.example.com tcp:127.0.0.1:8080" \
+  "target must start with unix: or upstream:"
+check_bad_native_fetcher_origin "bad.example.com upstream:origin random" \
+  "balancing must be round_robin or least_conn"
+
+# Prints statistic $2 of the virtual host $1.
+scrape_vhost_stat() {
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    "http://$1/ngx_pagespeed_statistics" | egrep "^$2:? " | awk '{print $2}'
+}
+
+# Requests an uncacheable stylesheet from the virtual host $1 until an IPRO
+# lookup finds it can't be rewritten, and then once more.  Checks that the last
+# request looked the resource up $2 times.
+check_ipro_negative_lookups() {
+  local host="$1"
+  local url="http://$host/mod_pagespeed_example/styles/yellow.css"
+  local message="Trying to serve rewritten resource in-place: $url"
+  local unrewritable="Could not rewrite resource in-place: $url"
+  for i in {1..100}; do
+    http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $url > /dev/null
+    if fgrep -q "$unrewritable" $ERROR_LOG; then
+      break
+    fi
+    sleep 0.1
+  done
+  check fgrep -q "$unrewritable" $ERROR_LOG
+  local not_rewritable=$(scrape_vhost_stat $host ipro_not_rewritable)
+  local lookups=$(fgrep -c "$message" $ERROR_LOG)
+
+  http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $url > /dev/null
+  check [ $(scrape_vhost_stat $host ipro_not_rewritable) \
+          -eq $((not_rewritable + $2)) ]
+  check [ $(fgrep -c "$message" $ERROR_LOG) -eq $((lookups + $2)) ]
+}
+
+start_test InPlaceNegativeLookupTtlMs skips lookups known to be unrewritable
+check_ipro_negative_lookups ipro-negative-lookup.example.com 0
+
+start_test IPRO looks up unrewritable resources every time by default
+check_ipro_negative_lookups ipro-negative-lookup-off.example.com 1
+
+start_test IPRO records concurrent misses for one resource only once
+HOST_NAME="ipro-claim.example.com"
+URL="http://$HOST_NAME/mod_pagespeed_example/images/Puzzle.jpg"
+NOT_IN_CACHE="because URL is not in cache: $URL"
+ALREADY_RECORDING="Not recording $URL: another worker is already recording it"
+# The origin takes a few seconds to send the image, so the first request is
+# still recording it when the others miss.
+PIDS=""
+for i in {1..4}; do
+  http_proxy=$SECONDARY_HOSTNAME $WGET -q -O /dev/null $URL &
+  PIDS+=" $!"
+done
+wait $PIDS
+check [ $(fgrep -c "$NOT_IN_CACHE" $ERROR_LOG) -eq 4 ]
+check [ $(fgrep -c "$ALREADY_RECORDING" $ERROR_LOG) -eq 3 ]
+
+start_test BeaconRateLimitMs answers repeated beacons without handling them
+HOST_NAME="beacon-rate-limit.example.com"
+URL="$SECONDARY_HOSTNAME/$BEACON_HANDLER"
+URL+="?url=http%3A%2F%2F$HOST_NAME%2Fmod_pagespeed_example%2Findex.html"
+QUEUED=$(scrape_vhost_stat $HOST_NAME beacons_queued)
+# Curl sends both beacons on one connection, which only works if the second
+# body is read and thrown away.
+CURL_LOG="$TEST_TMP/beacon-rate-limit.curl.log"
+OUT=$(curl -X POST --data "oh=1&n=2&cs=.big,.blue" -m 2 -s -v -o /dev/null \
+      -w '%{http_code}\n' -H "Host: $HOST_NAME" $URL $URL 2>"$CURL_LOG")
+check [ $(echo "$OUT" | grep -c '^204$') -eq 2 ]
+check fgrep -q "Re-using existing connection" "$CURL_LOG"
+check [ $(scrape_vhost_stat $HOST_NAME beacons_queued) -eq $((QUEUED + 1)) ]
+
+start_test BeaconRateLimitMs limits each kind of beacon separately
+# Critical css and critical image beacons for one page, each with its own
+# nonce, are both handled.
+URL="$SECONDARY_HOSTNAME/$BEACON_HANDLER"
+URL+="?url=http%3A%2F%2F$HOST_NAME%2Fmod_pagespeed_example%2Frewrite_css.html"
+QUEUED=$(scrape_vhost_stat $HOST_NAME beacons_queued)
+for KIND_DATA in "oh=1&n=3&cs=.big,.blue" "oh=1&n=4&ci=2932493096"; do
+  OUT=$(curl -X POST --data "$KIND_DATA" -m 2 -s -o /dev/null \
+        -w '%{http_code}' -H "Host: $HOST_NAME" $URL)
+  check [ "$OUT" = "204" ]
+done
+check [ $(scrape_vhost_stat $HOST_NAME beacons_queued) -eq $((QUEUED + 2)) ]
+
+start_test POSTed beacons larger than client_body_buffer_size are accepted
+HOST_NAME="beacon-temp-file.example.com"
+HOST_ERROR_LOG="$TEST_TMP/$HOST_NAME.error.log"
+URL="$SECONDARY_HOSTNAME/$BEACON_HANDLER"
+URL+="?url=http%3A%2F%2F$HOST_NAME%2Fmod_pagespeed_example%2Frewrite_css.html"
+# About 13k of critical css selectors, which nginx spills to a temp file.
+BEACON_DATA="oh=1&n=6&cs=.big"
+for i in {1..1000}; do
+  BEACON_DATA+=",.selector$i"
+done
+QUEUED=$(scrape_vhost_stat $HOST_NAME beacons_queued)
+APPLIED=$(scrape_vhost_stat $HOST_NAME beacons_applied)
+OUT=$(curl -X POST --data "$BEACON_DATA" -m 2 -s -o /dev/null \
+      -w '%{http_code}' -H "Host: $HOST_NAME" $URL)
+check [ "$OUT" = "204" ]
+check fgrep -q "a client request body is buffered to a temporary file" \
+  "$HOST_ERROR_LOG"
+check_not fgrep -q "ps_request_body_to_beacon_data" "$HOST_ERROR_LOG"
+check [ $(scrape_vhost_stat $HOST_NAME beacons_queued) -eq $((QUEUED + 1)) ]
+# Beacons are applied in batches on a background thread.
+for i in {1..50}; do
+  if [ $(scrape_vhost_stat $HOST_NAME beacons_applied) -gt $APPLIED ]; then
+    break
+  fi
+  sleep 0.1
+done
+check [ $(scrape_vhost_stat $HOST_NAME beacons_applied) -eq $((APPLIED + 1)) ]
+
+start_test RequestPhaseTiming logs phase timings and fills histograms
+HOST_NAME="request-phase-timing.example.com"
+URL="http://$HOST_NAME/mod_pagespeed_example/index.html"
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+TIMING_LOG="$TEST_TMP/request-phase-timing.access.log"
+TIMING_LINE="^/mod_pagespeed_example/index.html route=[0-9]+ options=[0-9]+"
+TIMING_LINE+=" import=[0-9]+ write=[0-9]+ collect=[0-9]+ export=[0-9]+$"
+# nginx writes the access log once it has sent the response, which may be
+# just after wget is done.
+for i in {1..10}; do
+  if egrep -q "$TIMING_LINE" $TIMING_LOG; then
+    break
+  fi
+  sleep 0.1
+done
+check egrep -q "$TIMING_LINE" $TIMING_LOG
+OUT=$(http_proxy=$SECONDARY_HOSTNAME \
+      $WGET_DUMP "http://$HOST_NAME/ngx_pagespeed_statistics")
+for PHASE in Route Options "Header Import" "Psol Write" "Collect Writes" \
+             "Header Export"; do
+  check_from "$OUT" fgrep -q "Ngx $PHASE Time us Histogram"
+done
 
 start_test PageSpeedFilters response headers is interpreted
 URL=$SECONDARY_HOSTNAME/mod_pagespeed_example/